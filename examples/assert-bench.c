@@ -0,0 +1,76 @@
+/*
+ * Throughput of passing assertions, as in tight validation loops. Every
+ * iteration checks 256 values, so the items per second reported by the
+ * runner are assertions per second. The size of the code generated for the
+ * assertions can be compared with `size assert-bench.o`.
+ */
+
+#include <stdbool.h>
+
+#include "scu.h"
+
+SCU_MODULE("Assertion benchmarks");
+
+#define NUM_VALUES 256
+
+static int values[NUM_VALUES];
+
+SCU_SETUP()
+{
+	for (int i = 0; i < NUM_VALUES; i++)
+		values[i] = i;
+}
+
+SCU_BENCH(plain, "Passing SCU_ASSERT", "cpu")
+{
+	SCU_BENCH_ITEMS(NUM_VALUES);
+	SCU_BENCH_LOOP {
+		SCU_BENCH_KEEP(values);
+		for (int i = 0; i < NUM_VALUES; i++)
+			SCU_ASSERT(values[i] == i);
+	}
+}
+
+SCU_BENCH(fatal, "Passing SCU_ASSERT_FATAL", "cpu")
+{
+	SCU_BENCH_ITEMS(NUM_VALUES);
+	SCU_BENCH_LOOP {
+		SCU_BENCH_KEEP(values);
+		for (int i = 0; i < NUM_VALUES; i++)
+			SCU_ASSERT_FATAL(values[i] == i);
+	}
+}
+
+SCU_BENCH(with_message, "Passing SCU_ASSERT_WITH_MESSAGE", "cpu")
+{
+	SCU_BENCH_ITEMS(NUM_VALUES);
+	SCU_BENCH_LOOP {
+		SCU_BENCH_KEEP(values);
+		for (int i = 0; i < NUM_VALUES; i++)
+			SCU_ASSERT_WITH_MESSAGE(values[i] == i, "values[%d] is %d", i, values[i]);
+	}
+}
+
+SCU_BENCH(unrolled, "Passing SCU_ASSERT_EQUAL, one call site per value", "cpu")
+{
+	SCU_BENCH_ITEMS(16);
+	SCU_BENCH_LOOP {
+		SCU_BENCH_KEEP(values);
+		SCU_ASSERT_EQUAL(values[0], 0);
+		SCU_ASSERT_EQUAL(values[1], 1);
+		SCU_ASSERT_EQUAL(values[2], 2);
+		SCU_ASSERT_EQUAL(values[3], 3);
+		SCU_ASSERT_EQUAL(values[4], 4);
+		SCU_ASSERT_EQUAL(values[5], 5);
+		SCU_ASSERT_EQUAL(values[6], 6);
+		SCU_ASSERT_EQUAL(values[7], 7);
+		SCU_ASSERT_EQUAL(values[8], 8);
+		SCU_ASSERT_EQUAL(values[9], 9);
+		SCU_ASSERT_EQUAL(values[10], 10);
+		SCU_ASSERT_EQUAL(values[11], 11);
+		SCU_ASSERT_EQUAL(values[12], 12);
+		SCU_ASSERT_EQUAL(values[13], 13);
+		SCU_ASSERT_EQUAL(values[14], 14);
+		SCU_ASSERT_EQUAL(values[15], 15);
+	}
+}
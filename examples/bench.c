@@ -0,0 +1,62 @@
+/*
+ * Benchmarks are test cases run repeatedly in a calibrated loop. The runner
+ * reports the time per iteration, and the throughput of benchmarks which
+ * declare how much data an iteration processes.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "scu.h"
+
+SCU_MODULE("Benchmarks");
+
+static char src[4096];
+static char dst[4096];
+
+SCU_BENCH(copy_page, "Copy a 4 KiB page", "memory")
+{
+	SCU_BENCH_BYTES(sizeof(src));
+	SCU_BENCH_LOOP {
+		memcpy(dst, src, sizeof(src));
+		SCU_BENCH_KEEP(dst);
+	}
+	SCU_ASSERT_MEM_EQUAL(dst, src, sizeof(src));
+}
+
+static int
+compare_ints(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+SCU_BENCH(sort_ints, "Sort 256 integers", "cpu")
+{
+	int values[256];
+	SCU_BENCH_ITEMS(256);
+	SCU_BENCH_LOOP {
+		/* Sorting a sorted array is a different benchmark, so restore the input */
+		for (int i = 0; i < 256; i++)
+			values[i] = (i * 7919) % 256;
+		qsort(values, 256, sizeof(values[0]), compare_ints);
+	}
+	SCU_ASSERT_EQUAL(values[0], 0);
+	SCU_ASSERT_EQUAL(values[255], 255);
+}
+
+SCU_BENCH(checksum, "Without a loop, every run is one iteration", "cpu")
+{
+	uint32_t sum = 0;
+	for (size_t i = 0; i < sizeof(src); i++)
+		sum = sum * 31 + src[i];
+	SCU_BENCH_KEEP(sum);
+}
+
+SCU_BENCH(failing, "Benchmark which fails an assertion")
+{
+	SCU_BENCH_LOOP {
+		SCU_BENCH_KEEP(src[0]);
+	}
+	SCU_ASSERT(false);
+}
@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "scu.h"
+
+SCU_MODULE("Bulk assertions");
+
+#define BUFFER_SIZE (1 << 20)
+
+static unsigned char *buffer1;
+static unsigned char *buffer2;
+
+SCU_SETUP()
+{
+	buffer1 = malloc(BUFFER_SIZE);
+	buffer2 = malloc(BUFFER_SIZE);
+}
+
+SCU_TEARDOWN()
+{
+	free(buffer1);
+	free(buffer2);
+}
+
+SCU_BEFORE_EACH()
+{
+	for (size_t i = 0; i < BUFFER_SIZE; i++)
+		buffer1[i] = buffer2[i] = i * 7;
+}
+
+SCU_TEST(mem_equal, "Compare large buffers")
+{
+	SCU_ASSERT_MEM_EQUAL(buffer1, buffer2, BUFFER_SIZE);
+}
+
+SCU_TEST(mem_equal_fail, "Compare large buffers which differ")
+{
+	buffer2[1000003] ^= 0x10;
+	buffer2[1000010] = 0;
+	buffer2[BUFFER_SIZE - 1] = 0;
+	SCU_ASSERT_MEM_EQUAL(buffer1, buffer2, BUFFER_SIZE);
+}
+
+SCU_TEST(array_equal, "Compare integer arrays")
+{
+	int32_t expected[] = {1, -2, 3, -4, 5, -6, 7, -8, 9};
+	int32_t actual[] = {1, -2, 3, -4, 5, -6, 7, -8, 9};
+	SCU_ASSERT_ARRAY_EQUAL(actual, expected, 9);
+	SCU_ASSERT_ARRAY_EQUAL((uint64_t *)buffer1, (uint64_t *)buffer2, BUFFER_SIZE / sizeof(uint64_t));
+}
+
+SCU_TEST(array_equal_fail, "Compare integer arrays which differ")
+{
+	int16_t expected[] = {1, -2, 3, -4, 5, -6, 7, -8, 9};
+	int16_t actual[] = {1, -2, 3, -4, 5, 6, 7, 8, 9};
+	SCU_ASSERT_ARRAY_EQUAL(actual, expected, 9);
+}
+
+SCU_TEST(float_array_near, "Compare float arrays with tolerance")
+{
+	double expected[] = {0.1, 0.2, 0.3, 0.0};
+	double actual[] = {0.1, 0.2, 0.1 + 0.2, -0.0};
+	SCU_ASSERT_FLOAT_ARRAY_NEAR(actual, expected, 4, 1e-12);
+	SCU_ASSERT_FLOAT_ARRAY_ULPS(actual, expected, 4, 1);
+}
+
+SCU_TEST(float_array_near_fail, "Compare float arrays which differ")
+{
+	float expected[] = {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f};
+	float actual[] = {1.0f, 2.0f, 3.001f, 4.0f, 5.0f, 6.5f};
+	SCU_ASSERT_FLOAT_ARRAY_ULPS(actual, expected, 6, 4);
+}
+
+SCU_TEST(string_array_equal, "Compare string arrays")
+{
+	const char *expected[] = {"foo", "bar", NULL, "baz"};
+	char baz[] = "baz";
+	const char *actual[] = {"foo", "bar", NULL, baz};
+	SCU_ASSERT_STRING_ARRAY_EQUAL(actual, expected, 4);
+}
+
+SCU_TEST(string_array_equal_fail, "Compare string arrays which differ")
+{
+	const char *expected[] = {"foo", "bar", "baz", "qux"};
+	const char *actual[] = {"foo", "bar", NULL, "quux"};
+	SCU_ASSERT_STRING_ARRAY_EQUAL(actual, expected, 4);
+}
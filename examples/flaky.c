@@ -0,0 +1,25 @@
+/*
+ * Tests which only misbehave in some of their runs, for showing the
+ * statistics of --repeat. Run once, every test passes quickly.
+ */
+
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "scu.h"
+
+SCU_MODULE("Flaky tests");
+
+SCU_TEST(every_fourth_run, "Test that fails every fourth run")
+{
+	static int runs;
+	SCU_ASSERT(++runs % 4 != 0);
+}
+
+SCU_TEST(slow_second_run, "Test whose second run is slow")
+{
+	static int runs;
+	if (++runs == 2)
+		usleep(20000);
+	SCU_ASSERT(true);
+}
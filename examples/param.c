@@ -0,0 +1,53 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "scu.h"
+
+SCU_MODULE("Parameterized tests");
+
+static void
+hex_encode(char *out, const unsigned char *in, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	for (size_t i = 0; i < len; i++) {
+		out[2 * i] = digits[in[i] >> 4];
+		out[2 * i + 1] = digits[in[i] & 15];
+	}
+	out[2 * len] = 0;
+}
+
+static const struct {
+	const char *input;
+	const char *hex;
+} hex_vectors[] = {
+    {"", ""},
+    {"f", "66"},
+    {"fo", "666f"},
+    {"foo", "666f6f"},
+    {"\x01\xff", "01ff"},
+};
+
+SCU_TEST_PARAM(hex, "Hex encoding of a test vector", hex_vectors, sizeof(hex_vectors) / sizeof(hex_vectors[0]))
+{
+	char out[64];
+	hex_encode(out, (const unsigned char *)param->input, strlen(param->input));
+	SCU_ASSERT_STRING_EQUAL(out, param->hex);
+}
+
+static const struct {
+	const char *label;
+	uint32_t value;
+	int bits;
+} popcount_vectors[] = {
+    {"zero", 0, 0},
+    {"one", 1, 1},
+    {"all", 0xffffffff, 32},
+    {"alternating", 0xaaaaaaaa, 16},
+    {"wrong", 0x7, 4},
+};
+
+SCU_TEST_PARAM_LABELED(popcount, "Population count", popcount_vectors,
+                       sizeof(popcount_vectors) / sizeof(popcount_vectors[0]), label, SCU_TAGS("bits"))
+{
+	SCU_ASSERT_EQUAL_FATAL(__builtin_popcount(param->value), param->bits);
+}
@@ -0,0 +1,57 @@
+/*
+ * A module with a large number of trivial test cases. The cost of running
+ * it is dominated by the test protocol, so it serves as a benchmark for the
+ * event encoder. Run it with SCU_PROTOCOL_STATS=1 in the environment to get
+ * the number of events and write() calls reported on stderr.
+ */
+
+#include <stdbool.h>
+
+#include "scu.h"
+
+SCU_MODULE("Protocol benchmark");
+
+#define BENCH_TEST(n) \
+	SCU_TEST(pass_##n, "Passing micro-test " #n) \
+	{ \
+		SCU_ASSERT(true); \
+		SCU_ASSERT_EQUAL(n, n); \
+	}
+
+#define BENCH_TESTS_10(n) \
+	BENCH_TEST(n##0) \
+	BENCH_TEST(n##1) \
+	BENCH_TEST(n##2) \
+	BENCH_TEST(n##3) \
+	BENCH_TEST(n##4) \
+	BENCH_TEST(n##5) \
+	BENCH_TEST(n##6) \
+	BENCH_TEST(n##7) \
+	BENCH_TEST(n##8) \
+	BENCH_TEST(n##9)
+
+#define BENCH_TESTS_100(n) \
+	BENCH_TESTS_10(n##0) \
+	BENCH_TESTS_10(n##1) \
+	BENCH_TESTS_10(n##2) \
+	BENCH_TESTS_10(n##3) \
+	BENCH_TESTS_10(n##4) \
+	BENCH_TESTS_10(n##5) \
+	BENCH_TESTS_10(n##6) \
+	BENCH_TESTS_10(n##7) \
+	BENCH_TESTS_10(n##8) \
+	BENCH_TESTS_10(n##9)
+
+BENCH_TESTS_100(1)
+BENCH_TESTS_100(2)
+BENCH_TESTS_100(3)
+BENCH_TESTS_100(4)
+BENCH_TESTS_100(5)
+
+SCU_TEST(fail_several, "Micro-test with a few failures")
+{
+	SCU_ASSERT(false);
+	SCU_ASSERT_EQUAL(1, 2);
+	SCU_ASSERT_STRING_EQUAL("foo", "bar");
+	SCU_FAIL("Explicit \"failure\" with characters to escape\n");
+}
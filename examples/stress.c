@@ -0,0 +1,58 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "scu.h"
+
+SCU_MODULE("Stress tests");
+
+#define THREADS 4
+#define ITERATIONS 100000
+
+static size_t counter;
+
+SCU_BEFORE_EACH()
+{
+	counter = 0;
+}
+
+SCU_STRESS(atomic_increment, "Concurrent atomic increments", THREADS, ITERATIONS)
+{
+	size_t before = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+	SCU_ASSERT(before < THREADS * ITERATIONS);
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+SCU_STRESS(mutex_increment, "Concurrent increments under a mutex", THREADS, ITERATIONS / 10)
+{
+	pthread_mutex_lock(&mutex);
+	size_t before = counter++;
+	pthread_mutex_unlock(&mutex);
+	SCU_ASSERT_FATAL(before < THREADS * ITERATIONS / 10);
+}
+
+SCU_STRESS(fatal_in_thread, "Fatal assertion failing in one of the threads", THREADS, 1000)
+{
+	SCU_ASSERT_FATAL(thread != 2 || iteration < 500);
+}
+
+static void *
+increment_thread(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 1000; i++) {
+		size_t before = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+		SCU_ASSERT(before < THREADS * 1000);
+	}
+	return NULL;
+}
+
+SCU_TEST(own_threads, "Assertions from threads started by the test")
+{
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++)
+		SCU_ASSERT_FATAL(pthread_create(&threads[i], NULL, increment_thread, NULL) == 0);
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	SCU_ASSERT_EQUAL(counter, THREADS * 1000);
+}
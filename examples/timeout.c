@@ -0,0 +1,36 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "scu.h"
+
+SCU_MODULE("Timeout");
+
+SCU_TEST(before_timeout, "This test will get executed")
+{
+	SCU_ASSERT(true);
+}
+
+static void *
+wait_forever(void *arg)
+{
+	(void)arg;
+	for (;;)
+		pause();
+	return NULL;
+}
+
+SCU_TEST(timeout, "Test that never finishes", SCU_TAGS("timeout=0.2"))
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, wait_forever, NULL);
+	printf("Waiting for a thread which never exits\n");
+	fflush(stdout);
+	pthread_join(thread, NULL);
+	SCU_ASSERT(true);
+}
+
+SCU_TEST(after_timeout, "This test will get executed in a new process")
+{
+	SCU_ASSERT(true);
+}
@@ -11,10 +11,9 @@ extern "C" {
 
 /* Configuration parameters */
 
-#define _SCU_MAX_TESTS 4096
-#define _SCU_MAX_TAGS 128
 #define _SCU_MAX_FAILURES 1024
 #define _SCU_FAILURE_MESSAGE_LENGTH 2048
+#define _SCU_FAILURE_ARENA_SIZE 131072
 
 /* Helper macros */
 
@@ -43,79 +42,183 @@ void _scu_after_each(void);
 #define SCU_AFTER_EACH() \
 	void _scu_after_each(void)
 
-/* Test module summary variable pointers */
+/* Test case state */
+
+/*
+ * A passing assertion only counts itself in thread-local state, and checks a
+ * thread-local flag when fatal. A thread is registered on its first
+ * assertion, so that the counts of all threads can be summed when the test
+ * case ends. Failures are handled out of line.
+ */
 
 typedef struct {
-	const char *file;
-	int line;
-	char msg[_SCU_FAILURE_MESSAGE_LENGTH];
-} _scu_failure;
+	size_t asserts;
+	bool registered;
+	bool fatal_assert_allowed;
+	/* Reported with failures; 0 for the thread running the test case, 1 and up for others */
+	int id;
+} _scu_thread_state;
+
+extern __thread _scu_thread_state _scu_thread;
 
-static bool *_scu_success __attribute__((used));
-static size_t *_scu_asserts __attribute__((used));
-static size_t *_scu_num_failures __attribute__((used));
-static _scu_failure *_scu_failures __attribute__((used));
+void _scu_register_thread(void) __attribute__((cold));
+
+#define _SCU_COUNT_ASSERT(is_fatal) \
+	do { \
+		if ((is_fatal) && !_scu_thread.fatal_assert_allowed) \
+			_scu_fatal_assert_not_allowed(__FILE__, __LINE__); \
+		if (__builtin_expect(!_scu_thread.registered, 0)) \
+			_scu_register_thread(); \
+		_scu_thread.asserts++; \
+	} while (0)
 
 /* Test case definition */
 
 typedef struct {
-	void (*func)(bool *, size_t *, size_t *, _scu_failure *);
+	void (*func)(void);
 	int line;
 	const char *name;
 	const char *desc;
-	const char *tags[_SCU_MAX_TAGS];
+	bool bench;
+	size_t num_tags;
+	const char *const *tags;
+	/* Rows of a parameterized test, each run as a test case of its own */
+	void (*param_func)(const void *);
+	const void *params;
+	size_t num_params;
+	size_t param_size;
+	long label_offset;
+	/* Body of a stress test, run by every thread for every iteration */
+	void (*stress_func)(size_t, size_t);
+	size_t stress_threads;
+	size_t stress_iterations;
 } _scu_testcase;
 
 void _scu_register_testcase(_scu_testcase *);
 
 #define SCU_TAGS(...) __VA_ARGS__
 
-#define SCU_TEST(name, desc, ...) \
+#define _SCU_TESTCASE(name, desc, bench, ...) \
 	static void name(void); \
-	static void _scu_test_wrapper_##name(bool *success, size_t *asserts, size_t *num_failures, \
-	                                     _scu_failure *failures) \
+	static void __attribute__((constructor)) _scu_register_##name(void) \
 	{ \
-		_scu_success = success; \
-		_scu_asserts = asserts; \
-		_scu_num_failures = num_failures; \
-		_scu_failures = failures; \
-		name(); \
+		static const char *const _scu_tags[] = {__VA_ARGS__}; \
+		static _scu_testcase _scu_tc = {name, __LINE__, #name, (desc), (bench), \
+		                                sizeof(_scu_tags) / sizeof(_scu_tags[0]), _scu_tags, NULL, NULL, 0, 0, -1, \
+		                                NULL, 0, 0}; \
+		_scu_register_testcase(&_scu_tc); \
+	} \
+	static void name(void)
+
+#define SCU_TEST(name, desc, ...) \
+	_SCU_TESTCASE(name, desc, false, __VA_ARGS__)
+
+/* Parameterized test definition */
+
+/*
+ * A parameterized test is run once for every row of a table, with param
+ * pointing to the row. Every row is listed as a test case of its own, named
+ * after the test and the row index, so rows are selected and scheduled like
+ * other test cases. The table and the number of rows must be known before
+ * setup, as they are when the table is a static array.
+ *
+ * SCU_TEST_PARAM_LABELED labels the rows with a string member of the row
+ * type, instead of with the row index.
+ */
+
+#define _SCU_TEST_PARAM(name, desc, table, count, label_offset, ...) \
+	static void name(const __typeof__((table)[0]) *param); \
+	static void _scu_param_##name(const void *param) \
+	{ \
+		name((const __typeof__((table)[0]) *)param); \
 	} \
 	static void __attribute__((constructor)) _scu_register_##name(void) \
 	{ \
-		static _scu_testcase tc = {_scu_test_wrapper_##name, __LINE__, #name, (desc), {__VA_ARGS__}}; \
-		_scu_register_testcase(&tc); \
+		static const char *const _scu_tags[] = {__VA_ARGS__}; \
+		static _scu_testcase _scu_tc = {NULL, __LINE__, #name, (desc), false, \
+		                                sizeof(_scu_tags) / sizeof(_scu_tags[0]), _scu_tags, \
+		                                _scu_param_##name, NULL, 0, sizeof((table)[0]), (label_offset), \
+		                                NULL, 0, 0}; \
+		_scu_tc.params = (table); \
+		_scu_tc.num_params = (count); \
+		_scu_register_testcase(&_scu_tc); \
 	} \
-	static void name(void)
+	static void name(const __typeof__((table)[0]) *param)
+
+#define SCU_TEST_PARAM(name, desc, table, count, ...) \
+	_SCU_TEST_PARAM(name, desc, table, count, -1, __VA_ARGS__)
+
+#define SCU_TEST_PARAM_LABELED(name, desc, table, count, label, ...) \
+	_SCU_TEST_PARAM(name, desc, table, count, __builtin_offsetof(__typeof__((table)[0]), label), __VA_ARGS__)
+
+/* Stress test definition */
+
+/*
+ * A stress test runs its body from a number of threads at once, each for a
+ * number of iterations, with thread set to the index of the thread and
+ * iteration to the index of the iteration. The threads are released together
+ * from a barrier, and the operations per second of every thread and of all of
+ * them are reported. Assertions may be used from the threads, and a failing
+ * fatal assertion ends the iterations of its thread. Failures are reported
+ * with the number of the thread, counting from 1.
+ */
+
+#define SCU_STRESS(name, desc, threads, iterations, ...) \
+	static void name(size_t thread, size_t iteration); \
+	static void __attribute__((constructor)) _scu_register_##name(void) \
+	{ \
+		static const char *const _scu_tags[] = {__VA_ARGS__}; \
+		static _scu_testcase _scu_tc = {NULL, __LINE__, #name, (desc), false, \
+		                                sizeof(_scu_tags) / sizeof(_scu_tags[0]), _scu_tags, NULL, NULL, 0, 0, -1, \
+		                                name, (threads), (iterations)}; \
+		_scu_register_testcase(&_scu_tc); \
+	} \
+	static void name(size_t thread __attribute__((unused)), size_t iteration __attribute__((unused)))
+
+/* Benchmark definition */
+
+/*
+ * A benchmark is a test case whose body is run repeatedly. The code to
+ * measure is put in a SCU_BENCH_LOOP, of which the framework calibrates the
+ * number of iterations. Code before the loop is not measured. The loop must
+ * not be left with break or return.
+ */
+
+size_t _scu_bench_start(void);
+void _scu_bench_stop(void);
+void _scu_bench_set_bytes(size_t);
+void _scu_bench_set_items(size_t);
+
+#define SCU_BENCH(name, desc, ...) \
+	_SCU_TESTCASE(name, desc, true, __VA_ARGS__)
+
+#define SCU_BENCH_LOOP \
+	for (size_t _scu_bench_i = 0, _scu_bench_n = _scu_bench_start(); \
+	     _scu_bench_i < _scu_bench_n || (_scu_bench_stop(), false); _scu_bench_i++)
+
+/* Number of bytes or items processed per iteration, for reporting throughput */
+#define SCU_BENCH_BYTES(n) _scu_bench_set_bytes(n)
+#define SCU_BENCH_ITEMS(n) _scu_bench_set_items(n)
+
+/* Keeps the compiler from optimizing away the computation of a value */
+#define SCU_BENCH_KEEP(value) __asm__ __volatile__("" : : "g"(value) : "memory")
 
 /* Test case addresses */
 
 /* Assertion functions */
 
-void _scu_fatal_assert_allowed(const char *, int);
-void _scu_handle_fatal_assert(void) __attribute__((noreturn));
+void _scu_fatal_assert_not_allowed(const char *, int) __attribute__((cold, noreturn));
+void _scu_handle_fatal_assert(void) __attribute__((cold, noreturn));
+void _scu_add_failure(const char *, int, const char *, ...) __attribute__((cold, format(printf, 3, 4)));
 
 #define SCU_FAIL(message) \
-	do { \
-		*_scu_success = false; \
-		if (*_scu_num_failures < _SCU_MAX_FAILURES) { \
-			_scu_failures[*_scu_num_failures].file = __FILE__; \
-			_scu_failures[*_scu_num_failures].line = __LINE__; \
-			strncpy(_scu_failures[*_scu_num_failures].msg, (message), _SCU_FAILURE_MESSAGE_LENGTH - 1); \
-			_scu_failures[*_scu_num_failures].msg[_SCU_FAILURE_MESSAGE_LENGTH - 1] = 0; \
-			(*_scu_num_failures)++; \
-		} \
-	} while (0)
+	_scu_add_failure(__FILE__, __LINE__, "%s", (message))
 
 #define _SCU_ASSERT_WITH_MESSAGE(test, is_fatal, message, ...) \
 	do { \
-		if (is_fatal) \
-			_scu_fatal_assert_allowed(__FILE__, __LINE__); \
-		(*_scu_asserts)++; \
-		if (!(test)) { \
-			char _scu_fmsg[_SCU_FAILURE_MESSAGE_LENGTH]; \
-			snprintf(_scu_fmsg, sizeof(_scu_fmsg), (message), ##__VA_ARGS__); \
-			SCU_FAIL(_scu_fmsg); \
+		_SCU_COUNT_ASSERT(is_fatal); \
+		if (__builtin_expect(!(test), 0)) { \
+			_scu_add_failure(__FILE__, __LINE__, (message), ##__VA_ARGS__); \
 			if (is_fatal) \
 				_scu_handle_fatal_assert(); \
 		} \
@@ -130,6 +233,72 @@ void _scu_handle_fatal_assert(void) __attribute__((noreturn));
 #define SCU_ASSERT(test) _SCU_ASSERT(test, false)
 #define SCU_ASSERT_FATAL(test) _SCU_ASSERT(test, true)
 
+/*
+ * Bulk assertions compare whole buffers or arrays as one assertion. A
+ * failure reports the first mismatch, the number of mismatching elements and
+ * the values around the first mismatch.
+ */
+
+bool _scu_check_mem(const char *, int, const char *, const char *, const void *, const void *, size_t);
+bool _scu_check_array(const char *, int, const char *, const char *, const void *, const void *, size_t, size_t, bool);
+bool _scu_check_real_array(const char *, int, const char *, const char *, const void *, const void *, size_t, size_t,
+                           double, unsigned long long);
+bool _scu_check_string_array(const char *, int, const char *, const char *, const char *const *, const char *const *,
+                             size_t);
+
+/* The check records the failure itself */
+#define _SCU_ASSERT_CHECK(check, is_fatal) \
+	do { \
+		_SCU_COUNT_ASSERT(is_fatal); \
+		if (__builtin_expect(!(check), 0) && (is_fatal)) \
+			_scu_handle_fatal_assert(); \
+	} while (0)
+
+/* Fails to compile when the element types of the arrays differ in size */
+#define _SCU_ELEMENT_SIZE(actual, expected) \
+	(sizeof(*(actual)) + 0 * sizeof(char[sizeof(*(actual)) == sizeof(*(expected)) ? 1 : -1]))
+
+#define _SCU_IS_SIGNED(value) ((__typeof__(value))-1 < (__typeof__(value))1)
+
+#define _SCU_CHECK_MEM(actual, expected, size) \
+	_scu_check_mem(__FILE__, __LINE__, #actual, #expected, (actual), (expected), (size))
+
+#define _SCU_CHECK_ARRAY(actual, expected, count) \
+	_scu_check_array(__FILE__, __LINE__, #actual, #expected, (actual), (expected), (count), \
+	                 _SCU_ELEMENT_SIZE(actual, expected), _SCU_IS_SIGNED(*(actual)))
+
+#define _SCU_CHECK_REAL_ARRAY(actual, expected, count, epsilon, ulps) \
+	_scu_check_real_array(__FILE__, __LINE__, #actual, #expected, (actual), (expected), (count), \
+	                      _SCU_ELEMENT_SIZE(actual, expected), (epsilon), (ulps))
+
+#define _SCU_CHECK_STRING_ARRAY(actual, expected, count) \
+	_scu_check_string_array(__FILE__, __LINE__, #actual, #expected, \
+	                        (const char *const *)(actual), (const char *const *)(expected), (count))
+
+/* Arrays of integers */
+#define SCU_ASSERT_ARRAY_EQUAL(actual, expected, count) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_ARRAY(actual, expected, count), false)
+#define SCU_ASSERT_ARRAY_EQUAL_FATAL(actual, expected, count) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_ARRAY(actual, expected, count), true)
+
+/* Arrays of floats or doubles, equal within an absolute difference */
+#define SCU_ASSERT_FLOAT_ARRAY_NEAR(actual, expected, count, epsilon) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_REAL_ARRAY(actual, expected, count, epsilon, 0), false)
+#define SCU_ASSERT_FLOAT_ARRAY_NEAR_FATAL(actual, expected, count, epsilon) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_REAL_ARRAY(actual, expected, count, epsilon, 0), true)
+
+/* Arrays of floats or doubles, equal within a number of units in the last place */
+#define SCU_ASSERT_FLOAT_ARRAY_ULPS(actual, expected, count, ulps) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_REAL_ARRAY(actual, expected, count, 0.0, ulps), false)
+#define SCU_ASSERT_FLOAT_ARRAY_ULPS_FATAL(actual, expected, count, ulps) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_REAL_ARRAY(actual, expected, count, 0.0, ulps), true)
+
+/* Arrays of strings, where NULL only equals NULL */
+#define SCU_ASSERT_STRING_ARRAY_EQUAL(actual, expected, count) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_STRING_ARRAY(actual, expected, count), false)
+#define SCU_ASSERT_STRING_ARRAY_EQUAL_FATAL(actual, expected, count) \
+	_SCU_ASSERT_CHECK(_SCU_CHECK_STRING_ARRAY(actual, expected, count), true)
+
 /* Convenience assertion macros */
 
 #define SCU_ASSERT_TRUE(val) \
@@ -145,7 +314,7 @@ void _scu_handle_fatal_assert(void) __attribute__((noreturn));
 	SCU_ASSERT((actual) != (expected))
 
 #define SCU_ASSERT_MEM_EQUAL(actual, expected, size) \
-	SCU_ASSERT(memcmp((actual), (expected), (size)) == 0)
+	_SCU_ASSERT_CHECK(_SCU_CHECK_MEM(actual, expected, size), false)
 
 #define SCU_ASSERT_PTR_NULL(ptr) \
 	SCU_ASSERT((ptr) == NULL)
@@ -178,7 +347,7 @@ void _scu_handle_fatal_assert(void) __attribute__((noreturn));
 	SCU_ASSERT_FATAL((actual) != (expected))
 
 #define SCU_ASSERT_MEM_EQUAL_FATAL(actual, expected, size) \
-	SCU_ASSERT_FATAL(memcmp((actual), (expected), (size)) == 0)
+	_SCU_ASSERT_CHECK(_SCU_CHECK_MEM(actual, expected, size), true)
 
 #define SCU_ASSERT_PTR_NULL_FATAL(ptr) \
 	SCU_ASSERT_FATAL((ptr) == NULL)
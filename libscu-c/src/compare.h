@@ -0,0 +1,160 @@
+#ifndef _COMPARE_H_
+#define _COMPARE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Comparison of large buffers, for the bulk assertions. Equal blocks are
+ * skipped with memcmp(), which the C library vectorizes for the CPU at hand.
+ * The first difference within a block is then located 64 bytes at a time with
+ * SSE2 where available, and a word at a time otherwise, so that only the
+ * elements around a difference have to be looked at individually.
+ */
+
+#define CMP_BLOCK_SIZE 4096
+
+/* Returns the offset of the first byte that differs, or size if there is none */
+static inline size_t __attribute__((used))
+cmp_first_mismatch(const void *a, const void *b, size_t size)
+{
+	const unsigned char *pa = a;
+	const unsigned char *pb = b;
+	size_t pos = 0;
+	while (pos + CMP_BLOCK_SIZE <= size && !memcmp(pa + pos, pb + pos, CMP_BLOCK_SIZE))
+		pos += CMP_BLOCK_SIZE;
+	if (pos + CMP_BLOCK_SIZE > size && !memcmp(pa + pos, pb + pos, size - pos))
+		return size;
+#ifdef __SSE2__
+	for (; pos + 64 <= size; pos += 64) {
+		__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + pos)),
+		                             _mm_loadu_si128((const __m128i *)(pb + pos)));
+		__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + pos + 16)),
+		                             _mm_loadu_si128((const __m128i *)(pb + pos + 16)));
+		__m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + pos + 32)),
+		                             _mm_loadu_si128((const __m128i *)(pb + pos + 32)));
+		__m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + pos + 48)),
+		                             _mm_loadu_si128((const __m128i *)(pb + pos + 48)));
+		__m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+	for (; pos + 16 <= size; pos += 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pa + pos)),
+		                            _mm_loadu_si128((const __m128i *)(pb + pos)));
+		unsigned int mask = _mm_movemask_epi8(eq) ^ 0xffff;
+		if (mask)
+			return pos + __builtin_ctz(mask);
+	}
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; pos + 8 <= size; pos += 8) {
+		uint64_t wa, wb;
+		memcpy(&wa, pa + pos, 8);
+		memcpy(&wb, pb + pos, 8);
+		if (wa != wb)
+			return pos + __builtin_ctzll(wa ^ wb) / 8;
+	}
+#endif
+	for (; pos < size; pos++) {
+		if (pa[pos] != pb[pos])
+			return pos;
+	}
+	return size;
+}
+
+/* Returns the index of the first element at or after start that differs bitwise, or count */
+static inline size_t __attribute__((used))
+cmp_next_mismatch(const void *a, const void *b, size_t start, size_t count, size_t elem_size)
+{
+	size_t offset = start * elem_size;
+	offset += cmp_first_mismatch((const char *)a + offset, (const char *)b + offset, count * elem_size - offset);
+	return offset / elem_size;
+}
+
+/* Reads an integer element of 1, 2, 4 or 8 bytes, sign extended if is_signed */
+static inline uint64_t __attribute__((used))
+cmp_load_integer(const void *p, size_t elem_size, bool is_signed)
+{
+	switch (elem_size) {
+	case 1: {
+		uint8_t v;
+		memcpy(&v, p, 1);
+		return is_signed ? (uint64_t)(int64_t)(int8_t)v : v;
+	}
+	case 2: {
+		uint16_t v;
+		memcpy(&v, p, 2);
+		return is_signed ? (uint64_t)(int64_t)(int16_t)v : v;
+	}
+	case 4: {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return is_signed ? (uint64_t)(int64_t)(int32_t)v : v;
+	}
+	default: {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		return v;
+	}
+	}
+}
+
+/* Reads a float or double element */
+static inline double __attribute__((used))
+cmp_load_real(const void *p, size_t elem_size)
+{
+	if (elem_size == sizeof(float)) {
+		float v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	double v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Distance in units in the last place between two floats or doubles. The
+ * bit patterns are mapped to integers that are ordered like the values, so
+ * that the distance is the difference between them.
+ */
+static inline uint64_t __attribute__((used))
+cmp_ulp_distance(const void *a, const void *b, size_t elem_size)
+{
+	int64_t ia, ib;
+	if (elem_size == sizeof(float)) {
+		int32_t fa, fb;
+		memcpy(&fa, a, sizeof(fa));
+		memcpy(&fb, b, sizeof(fb));
+		ia = fa < 0 ? INT32_MIN - (int64_t)fa : fa;
+		ib = fb < 0 ? INT32_MIN - (int64_t)fb : fb;
+	} else {
+		memcpy(&ia, a, sizeof(ia));
+		memcpy(&ib, b, sizeof(ib));
+		ia = ia < 0 ? INT64_MIN - ia : ia;
+		ib = ib < 0 ? INT64_MIN - ib : ib;
+	}
+	return ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+}
+
+/* Whether two elements that differ bitwise are within the tolerance */
+static inline bool __attribute__((used))
+cmp_real_close(const void *a, const void *b, size_t elem_size, double epsilon, uint64_t max_ulps)
+{
+	double va = cmp_load_real(a, elem_size);
+	double vb = cmp_load_real(b, elem_size);
+	if (va != va || vb != vb)
+		return va != va && vb != vb;
+	double diff = va > vb ? va - vb : vb - va;
+	if (diff <= epsilon)
+		return true;
+	return max_ulps && cmp_ulp_distance(a, b, elem_size) <= max_ulps;
+}
+
+#endif
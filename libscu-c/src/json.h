@@ -1,28 +1,171 @@
 #ifndef _JSON_H_
 #define _JSON_H_
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #define _SCU_JSON_STRING_LENGTH 1024
+#define _SCU_JSON_BUFFER_SIZE 65536
+#define _SCU_JSON_MAX_FDS 8
 
 #define _SCU_ASCII_BACKSLASH '\\'
 #define _SCU_ASCII_DOUBLE_QUOTE '"'
 
-static inline int __attribute__((used))
-json_true(int fd)
+/*
+ * Events are serialized into a statically allocated buffer and written to
+ * the file descriptor in one go when complete, so that an event normally
+ * costs a single write() call. Events that do not fit in the buffer are
+ * written out in buffer sized chunks.
+ *
+ * A framed buffer prefixes every write with a json_record_header. A record
+ * holding the first chunks of an event that did not fit in the buffer is
+ * marked as a fragment, to be joined with the records that follow it.
+ *
+ * File descriptors attached to a buffer written to a unix socket are passed
+ * along with the first byte of the next write. At most _SCU_JSON_MAX_FDS can
+ * be attached to a write, which the receiver must have room for.
+ */
+
+#define JSON_RECORD_EVENT 1
+#define JSON_RECORD_FRAGMENT 2
+
+typedef struct {
+	uint32_t size;
+	uint32_t type;
+} json_record_header;
+
+typedef struct {
+	int fd;
+	bool framed;
+	size_t num_fds;
+	int fds[_SCU_JSON_MAX_FDS];
+	size_t len;
+	size_t writes;
+	char data[_SCU_JSON_BUFFER_SIZE];
+} json_buffer;
+
+static inline ssize_t __attribute__((used))
+json_send_fds(json_buffer *buf, const void *data, size_t len)
+{
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(int) * _SCU_JSON_MAX_FDS)];
+	} control;
+	struct iovec iov = {(void *)data, len};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * buf->num_fds);
+
+	memset(&control, 0, sizeof(control));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * buf->num_fds);
+	memcpy(CMSG_DATA(cmsg), buf->fds, sizeof(int) * buf->num_fds);
+
+	ssize_t res = sendmsg(buf->fd, &msg, 0);
+	if (res >= 0)
+		buf->num_fds = 0;
+	return res;
+}
+
+/* Returns false if the fd can not be attached, as the next write already has the maximum number of fds */
+static inline bool __attribute__((used))
+json_attach_fd(json_buffer *buf, int fd)
+{
+	if (buf->num_fds == _SCU_JSON_MAX_FDS)
+		return false;
+	buf->fds[buf->num_fds++] = fd;
+	return true;
+}
+
+static inline void __attribute__((used))
+json_write(json_buffer *buf, const void *data, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t res;
+		if (buf->num_fds)
+			res = json_send_fds(buf, (const char *)data + pos, len - pos);
+		else
+			res = write(buf->fd, (const char *)data + pos, len - pos);
+		buf->writes++;
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pos += res;
+	}
+}
+
+static inline void __attribute__((used))
+json_reset(json_buffer *buf)
 {
-	return write(fd, "true", 4);
+	buf->len = buf->framed ? sizeof(json_record_header) : 0;
 }
 
-static inline int __attribute__((used))
-json_false(int fd)
+static inline void __attribute__((used))
+json_set_framed(json_buffer *buf, bool framed)
 {
-	return write(fd, "false", 5);
+	buf->framed = framed;
+	json_reset(buf);
 }
 
-#define json_boolean(stream, val) ((val) ? json_true(stream) : json_false(stream))
+static inline void __attribute__((used))
+json_flush_record(json_buffer *buf, uint32_t type)
+{
+	if (buf->framed) {
+		json_record_header header = {buf->len - sizeof(header), type};
+		memcpy(buf->data, &header, sizeof(header));
+	}
+	json_write(buf, buf->data, buf->len);
+	json_reset(buf);
+}
+
+static inline void __attribute__((used))
+json_flush(json_buffer *buf)
+{
+	json_flush_record(buf, JSON_RECORD_EVENT);
+}
+
+static inline void __attribute__((used))
+json_append(json_buffer *buf, const char *data, size_t len)
+{
+	while (len > 0) {
+		if (buf->len == _SCU_JSON_BUFFER_SIZE)
+			json_flush_record(buf, JSON_RECORD_FRAGMENT);
+		size_t n = _SCU_JSON_BUFFER_SIZE - buf->len;
+		if (n > len)
+			n = len;
+		memcpy(buf->data + buf->len, data, n);
+		buf->len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+static inline void __attribute__((used))
+json_true(json_buffer *buf)
+{
+	json_append(buf, "true", 4);
+}
+
+static inline void __attribute__((used))
+json_false(json_buffer *buf)
+{
+	json_append(buf, "false", 5);
+}
+
+#define json_boolean(buf, val) ((val) ? json_true(buf) : json_false(buf))
 
 static inline void __attribute__((used))
 json_escape_string(char *out, const char *in)
@@ -45,60 +188,88 @@ json_escape_string(char *out, const char *in)
 	out[out_i] = 0;
 }
 
-static inline int __attribute__((used))
-json_string(int fd, const char *value)
+static inline void __attribute__((used))
+json_string(json_buffer *buf, const char *value)
 {
 	char escaped[_SCU_JSON_STRING_LENGTH];
 	json_escape_string(escaped, value);
-	return dprintf(fd, "\"%s\"", escaped);
+	json_append(buf, "\"", 1);
+	json_append(buf, escaped, strlen(escaped));
+	json_append(buf, "\"", 1);
 }
 
-static inline int __attribute__((used))
-json_integer(int fd, int value)
+static inline void __attribute__((used))
+json_integer(json_buffer *buf, int value)
 {
-	return dprintf(fd, "%d", value);
+	char str[32];
+	int len = snprintf(str, sizeof(str), "%d", value);
+	json_append(buf, str, len);
 }
 
-static inline int __attribute__((used))
-json_real(int fd, double value)
+static inline void __attribute__((used))
+json_real(json_buffer *buf, double value)
 {
-	return dprintf(fd, "%f", value);
+	char str[32];
+	int len = snprintf(str, sizeof(str), "%f", value);
+	if (len >= (int)sizeof(str))
+		len = sizeof(str) - 1;
+	json_append(buf, str, len);
 }
 
-static inline int __attribute__((used))
-json_object_start(int fd)
+static inline void __attribute__((used))
+json_uint64(json_buffer *buf, uint64_t value)
+{
+	char str[32];
+	int len = snprintf(str, sizeof(str), "%" PRIu64, value);
+	json_append(buf, str, len);
+}
+
+static inline void __attribute__((used))
+json_fixed(json_buffer *buf, double value, int decimals)
+{
+	char str[64];
+	int len = snprintf(str, sizeof(str), "%.*f", decimals, value);
+	if (len >= (int)sizeof(str))
+		len = sizeof(str) - 1;
+	json_append(buf, str, len);
+}
+
+static inline void __attribute__((used))
+json_object_start(json_buffer *buf)
 {
-	return write(fd, "{", 1);
+	json_append(buf, "{", 1);
 }
 
-static inline int __attribute__((used))
-json_object_key(int fd, const char *key)
+static inline void __attribute__((used))
+json_object_key(json_buffer *buf, const char *key)
 {
-	return dprintf(fd, "\"%s\": ", key);
+	json_append(buf, "\"", 1);
+	json_append(buf, key, strlen(key));
+	json_append(buf, "\": ", 3);
 }
 
-static inline int __attribute__((used))
-json_object_end(int fd)
+static inline void __attribute__((used))
+json_object_end(json_buffer *buf)
 {
-	return write(fd, "}", 1);
+	json_append(buf, "}", 1);
 }
 
-static inline int __attribute__((used))
-json_array_start(int fd)
+static inline void __attribute__((used))
+json_array_start(json_buffer *buf)
 {
-	return write(fd, "[", 1);
+	json_append(buf, "[", 1);
 }
 
-static inline int __attribute__((used))
-json_array_end(int fd)
+static inline void __attribute__((used))
+json_array_end(json_buffer *buf)
 {
-	return write(fd, "]", 1);
+	json_append(buf, "]", 1);
 }
 
-static inline int __attribute__((used))
-json_separator(int fd)
+static inline void __attribute__((used))
+json_separator(json_buffer *buf)
 {
-	return write(fd, ", ", 2);
+	json_append(buf, ", ", 2);
 }
 
 #endif
@@ -1,13 +1,29 @@
 #include <argp.h>
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "compare.h"
 #include "json.h"
 #include "scu.h"
 
@@ -18,10 +34,10 @@
 #define VALGRIND_PRINTF(format, ...)
 #endif
 
-#define SCU_DOCUMENTATION "SCU test module\vExamples:\n  ./test --list\n  ./test --run 0 1 2"
+#define SCU_DOCUMENTATION "SCU test module\vExamples:\n  ./test --list\n  ./test --run 0 1 2\n  ./test --fork=4 --run 0 1 2\n  ./test --serve"
 
-#define SCU_OUTPUT_FILENAME_TEMPLATE "/tmp/scu.XXXXXX"
-#define SCU_OUTPUT_FILENAME_TEMPLATE_SIZE (strlen(SCU_OUTPUT_FILENAME_TEMPLATE) + 1)
+#define SCU_OUTPUT_DIR "/tmp"
+#define SCU_OUTPUT_FILENAME_LENGTH PATH_MAX
 
 /* Optional hook functions */
 
@@ -51,308 +67,1907 @@ extern const char *_scu_module_name;
 static _scu_testcase **_scu_module_tests;
 static size_t _scu_module_num_tests;
 
+/* Test cases by index, with a case for every row of a parameterized test */
+typedef struct {
+	_scu_testcase *test;
+	size_t row;
+} _scu_case;
+
+static _scu_case *_scu_module_cases;
+static size_t _scu_module_num_cases;
+
 /* Test protocol functions */
 
-static int _scu_cmd_fd;
+static json_buffer _scu_cmd;
+static size_t _scu_cmd_events;
+
+/*
+ * Test output is captured in an anonymous memfd when the protocol is written
+ * to a unix socket, over which the memfd is passed along with the event that
+ * refers to it. The event names the memfd by its inode number, which the
+ * runner matches with the fds it receives. Otherwise output is captured in a
+ * file in the output directory.
+ */
+
+static const char *_scu_output_dir = SCU_OUTPUT_DIR;
+static bool _scu_output_pass_fds;
+static bool _scu_output_memfd;
+static uint64_t _scu_output_inode;
+
+static void
+_scu_flush_json_buffer(json_buffer *cmd)
+{
+	if (!cmd->framed)
+		json_append(cmd, "\n", 1);
+	json_flush(cmd);
+	_scu_cmd_events++;
+}
+
+static void
+_scu_flush_json(void)
+{
+	_scu_flush_json_buffer(&_scu_cmd);
+}
+
+/* Resource usage of a test case, in the order of _scu_rusage_names */
+
+#define _SCU_RUSAGE_FIELDS 7
+
+typedef struct {
+	uint64_t values[_SCU_RUSAGE_FIELDS];
+} _scu_rusage;
+
+static const char *_scu_rusage_names[_SCU_RUSAGE_FIELDS] = {
+    "maxrss_kb", "minflt", "majflt", "nvcsw", "nivcsw", "inblock", "oublock"};
+
+static void
+_scu_get_rusage(_scu_rusage *usage)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	usage->values[0] = ru.ru_maxrss;
+	usage->values[1] = ru.ru_minflt;
+	usage->values[2] = ru.ru_majflt;
+	usage->values[3] = ru.ru_nvcsw;
+	usage->values[4] = ru.ru_nivcsw;
+	usage->values[5] = ru.ru_inblock;
+	usage->values[6] = ru.ru_oublock;
+}
+
+/* Replaces the usage at the start of a test case with the usage by the test case */
+static void
+_scu_rusage_delta(_scu_rusage *usage)
+{
+	_scu_rusage end;
+	_scu_get_rusage(&end);
+	for (size_t i = 0; i < _SCU_RUSAGE_FIELDS; i++)
+		usage->values[i] = end.values[i] - usage->values[i];
+}
+
+/*
+ * Compact protocol
+ *
+ * Events are sent as framed records instead of lines. Test cases that pass
+ * quickly without generating any output or notable resource usage are not
+ * reported individually, but collected into a batch which is sent as a single
+ * fixed layout record. The start of a
+ * test case is therefore held back until it is known whether it passes
+ * quietly, and is written by a signal handler should the test case crash.
+ */
+
+#define _SCU_MAX_PASS_BATCH 1024
+#define _SCU_RECORD_PASSES 3
+#define _SCU_QUIET_PASS_MAX_DURATION 0.001
+
+typedef struct {
+	json_record_header header;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t asserts;
+	double duration;
+	double cpu_time;
+	uint64_t rusage[_SCU_RUSAGE_FIELDS];
+	uint32_t indices[_SCU_MAX_PASS_BATCH];
+} _scu_pass_batch;
+
+static bool _scu_compact;
+static _scu_pass_batch _scu_passes;
+/* As large as the protocol buffer, so that a deferred record is never truncated */
+static char _scu_deferred_event[_SCU_JSON_BUFFER_SIZE];
+static size_t _scu_deferred_event_len;
+
+static void
+_scu_defer_json(void)
+{
+	json_record_header header = {_scu_cmd.len - sizeof(header), JSON_RECORD_EVENT};
+	memcpy(_scu_cmd.data, &header, sizeof(header));
+	_scu_deferred_event_len = _scu_cmd.len;
+	memcpy(_scu_deferred_event, _scu_cmd.data, _scu_deferred_event_len);
+	json_reset(&_scu_cmd);
+}
+
+static void
+_scu_flush_deferred_json(json_buffer *cmd)
+{
+	if (_scu_deferred_event_len) {
+		if (_scu_output_memfd)
+			json_attach_fd(cmd, STDOUT_FILENO);
+		json_write(cmd, _scu_deferred_event, _scu_deferred_event_len);
+		_scu_cmd_events++;
+		_scu_deferred_event_len = 0;
+	}
+}
+
+static void
+_scu_flush_passes(json_buffer *cmd)
+{
+	if (!_scu_passes.count)
+		return;
+
+	size_t size = offsetof(_scu_pass_batch, indices) + _scu_passes.count * sizeof(_scu_passes.indices[0]);
+	_scu_passes.header.size = size - sizeof(_scu_passes.header);
+	_scu_passes.header.type = _SCU_RECORD_PASSES;
+	json_write(cmd, &_scu_passes, size);
+	_scu_cmd_events++;
+
+	_scu_passes.count = 0;
+	_scu_passes.asserts = 0;
+	_scu_passes.duration = 0;
+	_scu_passes.cpu_time = 0;
+	memset(_scu_passes.rusage, 0, sizeof(_scu_passes.rusage));
+}
+
+static bool
+_scu_is_quiet_pass(double mono_time, const _scu_rusage *usage)
+{
+	struct stat st;
+	if (fstat(STDOUT_FILENO, &st) != 0 || st.st_size != 0)
+		return false;
+	/* Tests which stand out are reported individually, to be listed by the runner */
+	return mono_time < _SCU_QUIET_PASS_MAX_DURATION && !usage->values[0] && !usage->values[2] &&
+	       !usage->values[5] && !usage->values[6];
+}
+
+static void
+_scu_add_pass(int idx, size_t asserts, double mono_time, double cpu_time, const _scu_rusage *usage)
+{
+	if (_scu_passes.count == _SCU_MAX_PASS_BATCH)
+		_scu_flush_passes(&_scu_cmd);
+	_scu_passes.indices[_scu_passes.count++] = idx;
+	_scu_passes.asserts += asserts;
+	_scu_passes.duration += mono_time;
+	_scu_passes.cpu_time += cpu_time;
+	for (size_t i = 0; i < _SCU_RUSAGE_FIELDS; i++)
+		_scu_passes.rusage[i] += usage->values[i];
+}
+
+static void
+_scu_compact_crash_handler(int sig)
+{
+	_scu_flush_passes(&_scu_cmd);
+	_scu_flush_deferred_json(&_scu_cmd);
+	raise(sig);
+}
+
+static void
+_scu_enable_compact_protocol(void)
+{
+	_scu_compact = true;
+	json_set_framed(&_scu_cmd, true);
+
+	struct sigaction action = {.sa_handler = _scu_compact_crash_handler, .sa_flags = SA_RESETHAND | SA_NODEFER};
+	int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+		sigaction(signals[i], &action, NULL);
+}
+
+static void
+_scu_output_file(const char *filename)
+{
+	if (_scu_output_memfd) {
+		json_object_key(&_scu_cmd, "output_fd");
+		json_uint64(&_scu_cmd, _scu_output_inode);
+	} else {
+		json_object_key(&_scu_cmd, "output");
+		json_string(&_scu_cmd, filename);
+	}
+}
+
+static void
+_scu_flush_json_with_output(void)
+{
+	if (_scu_output_memfd)
+		json_attach_fd(&_scu_cmd, STDOUT_FILENO);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_module_list(const char *modulename)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "module_list");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "name");
+	json_string(&_scu_cmd, modulename);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_test_list(int line, const char *name, const char *description, size_t num_tags, const char *const *tags,
+                      const char *param)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "testcase_list");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "line");
+	json_integer(&_scu_cmd, line);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "name");
+	json_string(&_scu_cmd, name);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "description");
+	json_string(&_scu_cmd, description);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "tags");
+	json_array_start(&_scu_cmd);
+	for (size_t i = 0; i < num_tags; i++) {
+		if (i)
+			json_separator(&_scu_cmd);
+		json_string(&_scu_cmd, tags[i]);
+	}
+	json_array_end(&_scu_cmd);
+	if (param) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "param");
+		json_string(&_scu_cmd, param);
+	}
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_setup_start(const char *filename)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "setup_start");
+	json_separator(&_scu_cmd);
+	_scu_output_file(filename);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json_with_output();
+}
+static void
+_scu_output_setup_end(void)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "setup_end");
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_teardown_start(const char *filename)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "teardown_start");
+	json_separator(&_scu_cmd);
+	_scu_output_file(filename);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json_with_output();
+}
+static void
+_scu_output_teardown_end(void)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "teardown_end");
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_test_start(int idx, const char *name, const char *filename)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "testcase_start");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "index");
+	json_integer(&_scu_cmd, idx);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "name");
+	json_string(&_scu_cmd, name);
+	json_separator(&_scu_cmd);
+	_scu_output_file(filename);
+	json_object_end(&_scu_cmd);
+	if (_scu_compact)
+		_scu_defer_json();
+	else
+		_scu_flush_json_with_output();
+}
+
+/* Threads */
+
+/*
+ * The assertion counts of the threads other than the one running the test
+ * case are found through a table of their thread-local state. A thread
+ * claims a free slot when registering, and its count is moved to
+ * _scu_orphan_asserts when it exits, or immediately if there is no free slot.
+ * Slots are claimed and released with atomic operations, so that assertions
+ * never take a lock.
+ */
+
+#define _SCU_MAX_THREADS 1024
+
+__thread _scu_thread_state _scu_thread;
+
+static _scu_thread_state *_scu_threads[_SCU_MAX_THREADS];
+/* Number of slots that have been in use, which bounds the table scans */
+static size_t _scu_threads_used;
+static size_t _scu_orphan_asserts;
+static int _scu_next_thread_id;
+static pthread_key_t _scu_thread_key;
+static pthread_once_t _scu_thread_key_once = PTHREAD_ONCE_INIT;
+
+/* Called on thread exit, for registered threads */
+static void
+_scu_unregister_thread(void *arg)
+{
+	(void)arg;
+	size_t used = __atomic_load_n(&_scu_threads_used, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < used; i++) {
+		_scu_thread_state *expected = &_scu_thread;
+		if (__atomic_compare_exchange_n(&_scu_threads[i], &expected, NULL, false, __ATOMIC_ACQ_REL,
+		                                __ATOMIC_RELAXED))
+			break;
+	}
+	__atomic_fetch_add(&_scu_orphan_asserts, _scu_thread.asserts, __ATOMIC_RELAXED);
+	_scu_thread.asserts = 0;
+}
+
+static void
+_scu_create_thread_key(void)
+{
+	pthread_key_create(&_scu_thread_key, _scu_unregister_thread);
+}
+
+void
+_scu_register_thread(void)
+{
+	pthread_once(&_scu_thread_key_once, _scu_create_thread_key);
+	pthread_setspecific(_scu_thread_key, &_scu_thread);
+	_scu_thread.registered = true;
+	if (!_scu_thread.id)
+		_scu_thread.id = __atomic_add_fetch(&_scu_next_thread_id, 1, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < _SCU_MAX_THREADS; i++) {
+		_scu_thread_state *expected = NULL;
+		if (__atomic_compare_exchange_n(&_scu_threads[i], &expected, &_scu_thread, false, __ATOMIC_ACQ_REL,
+		                                __ATOMIC_RELAXED)) {
+			size_t used = __atomic_load_n(&_scu_threads_used, __ATOMIC_RELAXED);
+			while (used <= i && !__atomic_compare_exchange_n(&_scu_threads_used, &used, i + 1, true,
+			                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				;
+			return;
+		}
+	}
+}
+
+/* Between test cases, when other threads are not expected to assert */
+static void
+_scu_reset_asserts(void)
+{
+	size_t used = __atomic_load_n(&_scu_threads_used, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < used; i++) {
+		_scu_thread_state *thread = __atomic_load_n(&_scu_threads[i], __ATOMIC_ACQUIRE);
+		if (thread)
+			__atomic_store_n(&thread->asserts, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&_scu_orphan_asserts, 0, __ATOMIC_RELAXED);
+	_scu_thread.asserts = 0;
+}
+
+static size_t
+_scu_count_asserts(void)
+{
+	size_t asserts = _scu_thread.asserts + __atomic_load_n(&_scu_orphan_asserts, __ATOMIC_RELAXED);
+	size_t used = __atomic_load_n(&_scu_threads_used, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < used; i++) {
+		_scu_thread_state *thread = __atomic_load_n(&_scu_threads[i], __ATOMIC_ACQUIRE);
+		if (thread)
+			asserts += __atomic_load_n(&thread->asserts, __ATOMIC_RELAXED);
+	}
+	return asserts;
+}
+
+/* Failure records */
+
+/*
+ * The failures of a test case are appended to a statically allocated arena,
+ * each taking only the space of its message. Space is reserved with a
+ * compare-and-swap of the record count and the bytes used, packed in one
+ * word, so that threads can fail concurrently without a lock. Records carry
+ * a magic number, stored once the record is complete and checked when they
+ * are reported, so that a test overwriting the arena is detected rather than
+ * producing garbage. Failures which do not fit, by count or by size, are
+ * counted and reported as dropped.
+ */
+
+#define _SCU_FAILURE_MAGIC 0x5c0fa11u
+#define _SCU_FAILURE_ALIGN 8
+
+typedef struct {
+	uint32_t magic;
+	uint32_t length;
+	const char *file;
+	int line;
+	int thread;
+	bool truncated;
+	char msg[];
+} _scu_failure;
+
+#define _SCU_FAILURES_COUNT(reserved) ((size_t)((reserved) >> 32))
+#define _SCU_FAILURES_USED(reserved) ((size_t)((reserved)&0xffffffffu))
+
+static struct {
+	uint64_t reserved;
+	size_t dropped;
+	char data[_SCU_FAILURE_ARENA_SIZE] __attribute__((aligned(_SCU_FAILURE_ALIGN)));
+} _scu_failures;
+
+static void
+_scu_reset_failures(void)
+{
+	__atomic_store_n(&_scu_failures.reserved, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&_scu_failures.dropped, 0, __ATOMIC_RELAXED);
+}
+
+static bool
+_scu_test_passed(void)
+{
+	return !__atomic_load_n(&_scu_failures.reserved, __ATOMIC_RELAXED) &&
+	       !__atomic_load_n(&_scu_failures.dropped, __ATOMIC_RELAXED);
+}
+
+/* Position in the failure records, to tell whether a run added failures and to discard them */
+typedef struct {
+	uint64_t reserved;
+	size_t dropped;
+} _scu_failures_mark;
+
+static _scu_failures_mark
+_scu_mark_failures(void)
+{
+	return (_scu_failures_mark){__atomic_load_n(&_scu_failures.reserved, __ATOMIC_RELAXED),
+	                            __atomic_load_n(&_scu_failures.dropped, __ATOMIC_RELAXED)};
+}
+
+static bool
+_scu_failures_added(const _scu_failures_mark *mark)
+{
+	return __atomic_load_n(&_scu_failures.reserved, __ATOMIC_RELAXED) != mark->reserved ||
+	       __atomic_load_n(&_scu_failures.dropped, __ATOMIC_RELAXED) != mark->dropped;
+}
+
+static void
+_scu_restore_failures(const _scu_failures_mark *mark)
+{
+	__atomic_store_n(&_scu_failures.reserved, mark->reserved, __ATOMIC_RELAXED);
+	__atomic_store_n(&_scu_failures.dropped, mark->dropped, __ATOMIC_RELAXED);
+}
+
+void
+_scu_add_failure(const char *file, int line, const char *format, ...)
+{
+	char msg[_SCU_FAILURE_MESSAGE_LENGTH];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	if (length < 0)
+		length = 0;
+
+	uint64_t reserved = __atomic_load_n(&_scu_failures.reserved, __ATOMIC_RELAXED);
+	size_t used, max_length, size;
+	do {
+		used = _SCU_FAILURES_USED(reserved);
+		size_t space = _SCU_FAILURE_ARENA_SIZE - used;
+		if (_SCU_FAILURES_COUNT(reserved) == _SCU_MAX_FAILURES || space < sizeof(_scu_failure) + _SCU_FAILURE_ALIGN) {
+			__atomic_fetch_add(&_scu_failures.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		max_length = space - sizeof(_scu_failure) - 1;
+		if (max_length > sizeof(msg) - 1)
+			max_length = sizeof(msg) - 1;
+		if (max_length > (size_t)length)
+			max_length = length;
+		size = (sizeof(_scu_failure) + max_length + 1 + _SCU_FAILURE_ALIGN - 1) & ~(size_t)(_SCU_FAILURE_ALIGN - 1);
+	} while (!__atomic_compare_exchange_n(&_scu_failures.reserved, &reserved, reserved + ((uint64_t)1 << 32) + size,
+	                                      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	_scu_failure *failure = (_scu_failure *)(_scu_failures.data + used);
+	failure->truncated = (size_t)length > max_length;
+	failure->length = max_length;
+	failure->file = file;
+	failure->line = line;
+	failure->thread = _scu_thread.id;
+	memcpy(failure->msg, msg, max_length);
+	failure->msg[max_length] = 0;
+	__atomic_store_n(&failure->magic, _SCU_FAILURE_MAGIC, __ATOMIC_RELEASE);
+}
+
+static void
+_scu_output_test_failure(const char *file, int line, const char *msg, bool truncated, int thread)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "file");
+	json_string(&_scu_cmd, file);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "line");
+	json_integer(&_scu_cmd, line);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "message");
+	json_string(&_scu_cmd, msg);
+	if (thread) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "thread");
+		json_integer(&_scu_cmd, thread);
+	}
+	if (truncated) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "truncated");
+		json_true(&_scu_cmd);
+	}
+	json_object_end(&_scu_cmd);
+}
+
+static void
+_scu_output_test_failures(void)
+{
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "failures");
+	json_array_start(&_scu_cmd);
+	uint64_t reserved = __atomic_load_n(&_scu_failures.reserved, __ATOMIC_RELAXED);
+	size_t pos = 0;
+	for (size_t i = 0; i < _SCU_FAILURES_COUNT(reserved); i++) {
+		if (i)
+			json_separator(&_scu_cmd);
+		_scu_failure *failure = (_scu_failure *)(_scu_failures.data + pos);
+		if (pos + sizeof(_scu_failure) > _SCU_FAILURES_USED(reserved) ||
+		    __atomic_load_n(&failure->magic, __ATOMIC_ACQUIRE) != _SCU_FAILURE_MAGIC ||
+		    failure->length >= _SCU_FAILURE_MESSAGE_LENGTH || failure->msg[failure->length] != 0) {
+			_scu_output_test_failure(__FILE__, __LINE__, "Failure records have been overwritten by the test", false,
+			                         0);
+			break;
+		}
+		_scu_output_test_failure(failure->file, failure->line, failure->msg, failure->truncated, failure->thread);
+		size_t size = sizeof(_scu_failure) + failure->length + 1;
+		pos += (size + _SCU_FAILURE_ALIGN - 1) & ~(size_t)(_SCU_FAILURE_ALIGN - 1);
+	}
+	json_array_end(&_scu_cmd);
+	if (_scu_failures.dropped) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "failures_dropped");
+		json_integer(&_scu_cmd, _scu_failures.dropped);
+	}
+}
+
+/* Performance counters, in the order of _scu_perf_counters */
+
+#define _SCU_PERF_COUNTERS 7
+
+typedef struct {
+	bool available[_SCU_PERF_COUNTERS];
+	uint64_t values[_SCU_PERF_COUNTERS];
+} _scu_perf_values;
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} _scu_perf_counters[_SCU_PERF_COUNTERS] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static void
+_scu_output_perf_values(const _scu_perf_values *perf)
+{
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "perf");
+	json_object_start(&_scu_cmd);
+	bool first = true;
+	for (size_t i = 0; i < _SCU_PERF_COUNTERS; i++) {
+		if (!perf->available[i])
+			continue;
+		if (!first)
+			json_separator(&_scu_cmd);
+		first = false;
+		json_object_key(&_scu_cmd, _scu_perf_counters[i].name);
+		json_uint64(&_scu_cmd, perf->values[i]);
+	}
+	json_object_end(&_scu_cmd);
+}
+
+static void
+_scu_output_rusage(const _scu_rusage *usage)
+{
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "rusage");
+	json_object_start(&_scu_cmd);
+	for (size_t i = 0; i < _SCU_RUSAGE_FIELDS; i++) {
+		if (i)
+			json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, _scu_rusage_names[i]);
+		json_uint64(&_scu_cmd, usage->values[i]);
+	}
+	json_object_end(&_scu_cmd);
+}
+
+/* Statistics of the runs of a repeated test case, with times as minimum, median and maximum */
+typedef struct {
+	size_t runs;
+	size_t failed;
+	size_t first_failure;
+	double mono_time[3];
+	double cpu_time[3];
+} _scu_repeat_stats;
+
+static void
+_scu_output_time_stats(const char *key, const double *times)
+{
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, key);
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "min");
+	json_real(&_scu_cmd, times[0]);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "median");
+	json_real(&_scu_cmd, times[1]);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "max");
+	json_real(&_scu_cmd, times[2]);
+	json_object_end(&_scu_cmd);
+}
+
+static void
+_scu_output_repeat_stats(const _scu_repeat_stats *repeat)
+{
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "repeat");
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "runs");
+	json_uint64(&_scu_cmd, repeat->runs);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "failed");
+	json_uint64(&_scu_cmd, repeat->failed);
+	if (repeat->failed) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "first_failure");
+		json_uint64(&_scu_cmd, repeat->first_failure);
+	}
+	_scu_output_time_stats("duration", repeat->mono_time);
+	_scu_output_time_stats("cpu_time", repeat->cpu_time);
+	json_object_end(&_scu_cmd);
+}
+
+static void
+_scu_output_test_end(int idx, bool success, size_t asserts,
+                     double mono_time, double cpu_time,
+                     size_t valgrind_errors, const _scu_rusage *usage,
+                     const _scu_perf_values *perf, const _scu_repeat_stats *repeat)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "testcase_end");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "index");
+	json_integer(&_scu_cmd, idx);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "success");
+	json_boolean(&_scu_cmd, success);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "asserts");
+	json_uint64(&_scu_cmd, asserts);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "duration");
+	json_real(&_scu_cmd, mono_time);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "cpu_time");
+	json_real(&_scu_cmd, cpu_time);
+	_scu_output_test_failures();
+	if (valgrind_errors) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "valgrind_errors");
+		json_integer(&_scu_cmd, valgrind_errors);
+	}
+	_scu_output_rusage(usage);
+	if (perf)
+		_scu_output_perf_values(perf);
+	if (repeat)
+		_scu_output_repeat_stats(repeat);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+typedef struct {
+	size_t iterations;
+	size_t batches;
+	uint64_t total_ns;
+	double mean_ns;
+	double median_ns;
+	double stddev_ns;
+	double p99_ns;
+	double min_ns;
+	size_t bytes;
+	size_t items;
+} _scu_bench_result;
+
+static void
+_scu_output_bench_result(int idx, const _scu_bench_result *result)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "benchmark_result");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "index");
+	json_integer(&_scu_cmd, idx);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "iterations");
+	json_uint64(&_scu_cmd, result->iterations);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "batches");
+	json_uint64(&_scu_cmd, result->batches);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "total_ns");
+	json_uint64(&_scu_cmd, result->total_ns);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "mean_ns");
+	json_fixed(&_scu_cmd, result->mean_ns, 3);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "median_ns");
+	json_fixed(&_scu_cmd, result->median_ns, 3);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "stddev_ns");
+	json_fixed(&_scu_cmd, result->stddev_ns, 3);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "p99_ns");
+	json_fixed(&_scu_cmd, result->p99_ns, 3);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "min_ns");
+	json_fixed(&_scu_cmd, result->min_ns, 3);
+	if (result->bytes) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "bytes_per_op");
+		json_uint64(&_scu_cmd, result->bytes);
+	}
+	if (result->items) {
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "items_per_op");
+		json_uint64(&_scu_cmd, result->items);
+	}
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+typedef struct {
+	size_t threads;
+	size_t iterations;
+	/* From the release of the threads until the last one is done */
+	uint64_t total_ns;
+	/* Iterations completed by each thread, and the time it took */
+	size_t *ops;
+	uint64_t *ns;
+} _scu_stress_result;
+
+static void
+_scu_output_stress_result(int idx, const _scu_stress_result *result)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "stress_result");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "index");
+	json_integer(&_scu_cmd, idx);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "threads");
+	json_uint64(&_scu_cmd, result->threads);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "iterations");
+	json_uint64(&_scu_cmd, result->iterations);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "total_ns");
+	json_uint64(&_scu_cmd, result->total_ns);
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "per_thread");
+	json_array_start(&_scu_cmd);
+	for (size_t i = 0; i < result->threads; i++) {
+		if (i)
+			json_separator(&_scu_cmd);
+		json_object_start(&_scu_cmd);
+		json_object_key(&_scu_cmd, "ops");
+		json_uint64(&_scu_cmd, result->ops[i]);
+		json_separator(&_scu_cmd);
+		json_object_key(&_scu_cmd, "ns");
+		json_uint64(&_scu_cmd, result->ns[i]);
+		json_object_end(&_scu_cmd);
+	}
+	json_array_end(&_scu_cmd);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_test_error_event(json_buffer *cmd, const char *file, int line, const char *msg, bool timeout)
+{
+	json_object_start(cmd);
+	json_object_key(cmd, "event");
+	json_string(cmd, "testcase_error");
+	json_separator(cmd);
+	json_object_key(cmd, "message");
+	json_string(cmd, msg);
+	json_separator(cmd);
+	if (file) {
+		json_object_key(cmd, "file");
+		json_string(cmd, file);
+		json_separator(cmd);
+		json_object_key(cmd, "line");
+		json_integer(cmd, line);
+		json_separator(cmd);
+	}
+	if (timeout) {
+		json_object_key(cmd, "timeout");
+		json_true(cmd);
+		json_separator(cmd);
+	}
+	json_object_key(cmd, "crash");
+	json_true(cmd);
+	json_object_end(cmd);
+	_scu_flush_json_buffer(cmd);
+}
+
+static void
+_scu_output_test_error(const char *file, int line, const char *msg)
+{
+	_scu_output_test_error_event(&_scu_cmd, file, line, msg, false);
+}
+
+static void
+_scu_output_command_error(const char *msg)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "command_error");
+	json_separator(&_scu_cmd);
+	json_object_key(&_scu_cmd, "message");
+	json_string(&_scu_cmd, msg);
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_output_command_end(void)
+{
+	json_object_start(&_scu_cmd);
+	json_object_key(&_scu_cmd, "event");
+	json_string(&_scu_cmd, "command_end");
+	json_object_end(&_scu_cmd);
+	_scu_flush_json();
+}
+
+static void
+_scu_redirect_output(char *filename, size_t len)
+{
+	int out = -1;
+#ifdef SYS_memfd_create
+	if (_scu_output_pass_fds)
+		out = syscall(SYS_memfd_create, "scu-output", 0);
+#endif
+	_scu_output_memfd = out >= 0;
+	if (_scu_output_memfd) {
+		struct stat st;
+		fstat(out, &st);
+		_scu_output_inode = st.st_ino;
+		filename[0] = 0;
+	} else {
+		snprintf(filename, len, "%s/scu.XXXXXX", _scu_output_dir);
+		out = mkstemp(filename);
+	}
+	assert(out >= 0);
+	dup2(out, STDOUT_FILENO);
+	dup2(out, STDERR_FILENO);
+	close(out);
+	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stderr, NULL, _IONBF, 0);
+}
+
+/*
+ * A test case that writes to the protocol stream would go unnoticed if
+ * batched as a quiet pass. With the compact protocol, the stream is therefore
+ * moved to a high fd number, and its old number given to a guard file, which
+ * is checked for writes after every test case.
+ */
+
+#define _SCU_PROTOCOL_FD_MIN 100
+
+static int _scu_protocol_guard_fd = -1;
+
+static void
+_scu_open_protocol_guard(void)
+{
+	int guard = -1;
+#ifdef SYS_memfd_create
+	guard = syscall(SYS_memfd_create, "scu-protocol-guard", 0);
+#endif
+	if (guard < 0) {
+		char filename[SCU_OUTPUT_FILENAME_LENGTH];
+		snprintf(filename, sizeof(filename), "%s/scu.XXXXXX", _scu_output_dir);
+		guard = mkstemp(filename);
+		assert(guard >= 0);
+		unlink(filename);
+	}
+	dup2(guard, _scu_protocol_guard_fd);
+	close(guard);
+}
+
+static void
+_scu_guard_protocol_fd(void)
+{
+	int fd = fcntl(_scu_cmd.fd, F_DUPFD, _SCU_PROTOCOL_FD_MIN);
+	assert(fd >= 0);
+	_scu_protocol_guard_fd = _scu_cmd.fd;
+	_scu_cmd.fd = fd;
+	_scu_open_protocol_guard();
+}
+
+/* Fails the running test case if anything has been written to the guard */
+static void
+_scu_check_protocol_guard(void)
+{
+	struct stat st;
+	if (_scu_protocol_guard_fd < 0 || fstat(_scu_protocol_guard_fd, &st) != 0 || st.st_size == 0)
+		return;
+	_scu_add_failure(__FILE__, __LINE__, "Test case wrote %lld bytes to the protocol stream", (long long)st.st_size);
+	ftruncate(_scu_protocol_guard_fd, 0);
+	lseek(_scu_protocol_guard_fd, 0, SEEK_SET);
+}
+
+/* Test cases */
+
+static void
+_scu_expand_cases(void)
+{
+	_scu_module_num_cases = 0;
+	for (size_t i = 0; i < _scu_module_num_tests; i++)
+		_scu_module_num_cases += _scu_module_tests[i]->param_func ? _scu_module_tests[i]->num_params : 1;
+
+	_scu_module_cases = malloc(sizeof(_scu_case) * (_scu_module_num_cases + 1));
+	size_t idx = 0;
+	for (size_t i = 0; i < _scu_module_num_tests; i++) {
+		_scu_testcase *test = _scu_module_tests[i];
+		size_t rows = test->param_func ? test->num_params : 1;
+		for (size_t row = 0; row < rows; row++)
+			_scu_module_cases[idx++] = (_scu_case){test, row};
+	}
+}
+
+/* Name of a test case, with the row index appended for a row of a parameterized test */
+static const char *
+_scu_case_name(const _scu_case *tc, char *buf, size_t size)
+{
+	if (!tc->test->param_func)
+		return tc->test->name;
+	snprintf(buf, size, "%s/%zu", tc->test->name, tc->row);
+	return buf;
+}
+
+/* Label of a row of a parameterized test, or NULL for other test cases */
+static const char *
+_scu_case_label(const _scu_case *tc, char *buf, size_t size)
+{
+	_scu_testcase *test = tc->test;
+	if (!test->param_func)
+		return NULL;
+	if (test->label_offset < 0) {
+		snprintf(buf, size, "%zu", tc->row);
+		return buf;
+	}
+	const char *row = (const char *)test->params + tc->row * test->param_size;
+	const char *label;
+	memcpy(&label, row + test->label_offset, sizeof(label));
+	return label ? label : "(null)";
+}
+
+static const void *
+_scu_case_param(const _scu_case *tc)
+{
+	return (const char *)tc->test->params + tc->row * tc->test->param_size;
+}
+
+/* Module actions */
+
+static void
+list_tests(void)
+{
+	_scu_output_module_list(_scu_module_name);
+
+	for (size_t i = 0; i < _scu_module_num_cases; i++) {
+		_scu_case *tc = &_scu_module_cases[i];
+		char name[_SCU_JSON_STRING_LENGTH];
+		char label[32];
+		_scu_output_test_list(tc->test->line, _scu_case_name(tc, name, sizeof(name)), tc->test->desc,
+		                      tc->test->num_tags, tc->test->tags, _scu_case_label(tc, label, sizeof(label)));
+	}
+}
+
+static double
+_scu_get_time_diff(struct timespec startt, struct timespec endt)
+{
+	time_t dsec = endt.tv_sec - startt.tv_sec;
+	long dnsec = endt.tv_nsec - startt.tv_nsec;
+
+	if (dnsec < 0) {
+		dnsec += 1000000000;
+		dsec--;
+	}
+
+	return dsec + dnsec / 1e9;
+}
+
+/* Where a failing fatal assertion returns to, in the threads which allow them */
+static bool _scu_fatal_assert_jmpbuf_valid;
+static jmp_buf _scu_main_jmpbuf;
+static __thread jmp_buf *_scu_fatal_assert_jmpbuf;
+
+static pid_t
+_scu_get_current_thread_id(void)
+{
+	return syscall(SYS_gettid);
+}
+
+void
+_scu_fatal_assert_not_allowed(const char *file, int line)
+{
+	assert(_scu_fatal_assert_jmpbuf_valid);
+	_scu_output_test_error(file, line, "Attempt to use fatal assert outside main thread or stress test threads");
+	abort();
+}
+
+void
+_scu_handle_fatal_assert(void)
+{
+	longjmp(*_scu_fatal_assert_jmpbuf, 1);
+}
+
+/* Bulk assertions */
+
+/* Number of elements shown on either side of the first mismatch */
+#define _SCU_BULK_CONTEXT 2
+/* Length at which expressions and strings are cut in the report */
+#define _SCU_BULK_TEXT_LENGTH 64
+
+typedef struct {
+	size_t len;
+	char data[_SCU_JSON_STRING_LENGTH];
+} _scu_report;
+
+static void __attribute__((format(printf, 2, 3)))
+_scu_report_append(_scu_report *report, const char *format, ...)
+{
+	if (report->len >= sizeof(report->data) - 1)
+		return;
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(report->data + report->len, sizeof(report->data) - report->len, format, args);
+	va_end(args);
+	if (length > 0)
+		report->len += length;
+	if (report->len > sizeof(report->data) - 1)
+		report->len = sizeof(report->data) - 1;
+}
+
+/* Appends rows of 16 bytes from both buffers around the byte at offset, marking the bytes that differ */
+static void
+_scu_report_hexdump(_scu_report *report, const unsigned char *actual, const unsigned char *expected, size_t offset,
+                    size_t size)
+{
+	size_t start = offset & ~(size_t)15;
+	start = start >= 16 ? start - 16 : 0;
+	for (size_t row = start; row < size && row < start + 48; row += 16) {
+		_scu_report_append(report, "\n  %08zx  actual  ", row);
+		for (size_t i = row; i < row + 16 && i < size; i++)
+			_scu_report_append(report, " %02x", actual[i]);
+		_scu_report_append(report, "\n            expected");
+		for (size_t i = row; i < row + 16 && i < size; i++)
+			_scu_report_append(report, " %02x", expected[i]);
+		size_t last = row;
+		for (size_t i = row; i < row + 16 && i < size; i++) {
+			if (actual[i] != expected[i])
+				last = i + 1;
+		}
+		if (last > row) {
+			_scu_report_append(report, "\n                    ");
+			for (size_t i = row; i < last; i++)
+				_scu_report_append(report, actual[i] != expected[i] ? " ^^" : "   ");
+		}
+	}
+}
+
+static size_t
+_scu_count_mismatches(const void *actual, const void *expected, size_t first, size_t count, size_t elem_size)
+{
+	size_t mismatches = 0;
+	for (size_t i = first; i < count; i = cmp_next_mismatch(actual, expected, i + 1, count, elem_size))
+		mismatches++;
+	return mismatches;
+}
+
+bool
+_scu_check_mem(const char *file, int line, const char *actual_expr, const char *expected_expr,
+               const void *actual, const void *expected, size_t size)
+{
+	size_t first = cmp_first_mismatch(actual, expected, size);
+	if (__builtin_expect(first == size, 1))
+		return true;
+
+	_scu_report report = {0};
+	_scu_report_append(&report, "assertion failure: %.*s == %.*s, %zu of %zu bytes differ, first at offset %zu",
+	                   _SCU_BULK_TEXT_LENGTH, actual_expr, _SCU_BULK_TEXT_LENGTH, expected_expr,
+	                   _scu_count_mismatches(actual, expected, first, size, 1), size, first);
+	_scu_report_hexdump(&report, actual, expected, first, size);
+	_scu_add_failure(file, line, "%s", report.data);
+	return false;
+}
+
+static void
+_scu_report_integer(_scu_report *report, const void *p, size_t elem_size, bool is_signed)
+{
+	uint64_t value = cmp_load_integer(p, elem_size, is_signed);
+	if (is_signed)
+		_scu_report_append(report, "  %20" PRId64, (int64_t)value);
+	else
+		_scu_report_append(report, "  %20" PRIu64, value);
+}
+
+bool
+_scu_check_array(const char *file, int line, const char *actual_expr, const char *expected_expr,
+                 const void *actual, const void *expected, size_t count, size_t elem_size, bool is_signed)
+{
+	size_t first = cmp_next_mismatch(actual, expected, 0, count, elem_size);
+	if (__builtin_expect(first == count, 1))
+		return true;
+
+	_scu_report report = {0};
+	_scu_report_append(&report, "assertion failure: %.*s == %.*s, %zu of %zu elements differ, first at index %zu",
+	                   _SCU_BULK_TEXT_LENGTH, actual_expr, _SCU_BULK_TEXT_LENGTH, expected_expr,
+	                   _scu_count_mismatches(actual, expected, first, count, elem_size), count, first);
+	if (elem_size != 1 && elem_size != 2 && elem_size != 4 && elem_size != 8) {
+		size_t offset = first * elem_size;
+		offset += cmp_first_mismatch((const char *)actual + offset, (const char *)expected + offset, elem_size);
+		_scu_report_hexdump(&report, actual, expected, offset, count * elem_size);
+	} else {
+		_scu_report_append(&report, "\n    %-10s  %20s  %20s", "index", "actual", "expected");
+		size_t start = first >= _SCU_BULK_CONTEXT ? first - _SCU_BULK_CONTEXT : 0;
+		for (size_t i = start; i < count && i <= first + _SCU_BULK_CONTEXT; i++) {
+			const void *a = (const char *)actual + i * elem_size;
+			const void *e = (const char *)expected + i * elem_size;
+			_scu_report_append(&report, "\n  %c %-10zu", memcmp(a, e, elem_size) ? '*' : ' ', i);
+			_scu_report_integer(&report, a, elem_size, is_signed);
+			_scu_report_integer(&report, e, elem_size, is_signed);
+		}
+	}
+	_scu_add_failure(file, line, "%s", report.data);
+	return false;
+}
+
+/* Returns the index of the first element at or after start that is not within the tolerance, or count */
+static size_t
+_scu_next_real_mismatch(const void *actual, const void *expected, size_t start, size_t count, size_t elem_size,
+                        double epsilon, uint64_t max_ulps)
+{
+	for (size_t i = cmp_next_mismatch(actual, expected, start, count, elem_size); i < count;
+	     i = cmp_next_mismatch(actual, expected, i + 1, count, elem_size)) {
+		if (!cmp_real_close((const char *)actual + i * elem_size, (const char *)expected + i * elem_size, elem_size,
+		                    epsilon, max_ulps))
+			return i;
+	}
+	return count;
+}
+
+bool
+_scu_check_real_array(const char *file, int line, const char *actual_expr, const char *expected_expr,
+                      const void *actual, const void *expected, size_t count, size_t elem_size, double epsilon,
+                      unsigned long long max_ulps)
+{
+	if (elem_size != sizeof(float) && elem_size != sizeof(double)) {
+		_scu_add_failure(file, line, "assertion failure: %.*s has elements of %zu bytes, not float or double",
+		                 _SCU_BULK_TEXT_LENGTH, actual_expr, elem_size);
+		return false;
+	}
+	size_t first = _scu_next_real_mismatch(actual, expected, 0, count, elem_size, epsilon, max_ulps);
+	if (__builtin_expect(first == count, 1))
+		return true;
+
+	size_t mismatches = 0;
+	for (size_t i = first; i < count;
+	     i = _scu_next_real_mismatch(actual, expected, i + 1, count, elem_size, epsilon, max_ulps))
+		mismatches++;
+
+	const void *a = (const char *)actual + first * elem_size;
+	const void *e = (const char *)expected + first * elem_size;
+	double diff = cmp_load_real(a, elem_size) - cmp_load_real(e, elem_size);
+	_scu_report report = {0};
+	_scu_report_append(&report, "assertion failure: %.*s == %.*s, %zu of %zu elements differ, first at index %zu "
+	                   "by %g (%llu ulps)",
+	                   _SCU_BULK_TEXT_LENGTH, actual_expr, _SCU_BULK_TEXT_LENGTH, expected_expr, mismatches, count,
+	                   first, diff, (unsigned long long)cmp_ulp_distance(a, e, elem_size));
+	_scu_report_append(&report, "\n    %-10s  %24s  %24s", "index", "actual", "expected");
+	int precision = elem_size == sizeof(float) ? 9 : 17;
+	size_t start = first >= _SCU_BULK_CONTEXT ? first - _SCU_BULK_CONTEXT : 0;
+	for (size_t i = start; i < count && i <= first + _SCU_BULK_CONTEXT; i++) {
+		a = (const char *)actual + i * elem_size;
+		e = (const char *)expected + i * elem_size;
+		bool close = !memcmp(a, e, elem_size) || cmp_real_close(a, e, elem_size, epsilon, max_ulps);
+		_scu_report_append(&report, "\n  %c %-10zu  %24.*g  %24.*g", close ? ' ' : '*', i,
+		                   precision, cmp_load_real(a, elem_size), precision, cmp_load_real(e, elem_size));
+	}
+	_scu_add_failure(file, line, "%s", report.data);
+	return false;
+}
+
+static bool
+_scu_strings_equal(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+static void
+_scu_report_string(_scu_report *report, const char *str)
+{
+	if (!str)
+		_scu_report_append(report, "NULL");
+	else
+		_scu_report_append(report, "\"%.*s\"%s", _SCU_BULK_TEXT_LENGTH, str,
+		                   strlen(str) > _SCU_BULK_TEXT_LENGTH ? "..." : "");
+}
+
+bool
+_scu_check_string_array(const char *file, int line, const char *actual_expr, const char *expected_expr,
+                        const char *const *actual, const char *const *expected, size_t count)
+{
+	size_t first = 0;
+	while (first < count && _scu_strings_equal(actual[first], expected[first]))
+		first++;
+	if (__builtin_expect(first == count, 1))
+		return true;
+
+	size_t mismatches = 0;
+	for (size_t i = first; i < count; i++)
+		mismatches += !_scu_strings_equal(actual[i], expected[i]);
+
+	_scu_report report = {0};
+	_scu_report_append(&report, "assertion failure: %.*s == %.*s, %zu of %zu strings differ, first at index %zu",
+	                   _SCU_BULK_TEXT_LENGTH, actual_expr, _SCU_BULK_TEXT_LENGTH, expected_expr, mismatches, count,
+	                   first);
+	size_t start = first >= _SCU_BULK_CONTEXT ? first - _SCU_BULK_CONTEXT : 0;
+	for (size_t i = start; i < count && i <= first + _SCU_BULK_CONTEXT; i++) {
+		bool equal = _scu_strings_equal(actual[i], expected[i]);
+		_scu_report_append(&report, "\n  %c %-10zu  actual   ", equal ? ' ' : '*', i);
+		_scu_report_string(&report, actual[i]);
+		if (!equal) {
+			_scu_report_append(&report, "\n    %-10s  expected ", "");
+			_scu_report_string(&report, expected[i]);
+		}
+	}
+	_scu_add_failure(file, line, "%s", report.data);
+	return false;
+}
+
+/* Benchmarks */
+
+#define _SCU_BENCH_WARMUP_BATCHES 5
+#define _SCU_BENCH_BATCHES 50
+#define _SCU_BENCH_BATCH_NS 4000000.0
+#define _SCU_BENCH_MAX_ITERATIONS ((size_t)1 << 40)
+
+static struct {
+	size_t iterations;
+	bool loop_used;
+	uint64_t start_ns;
+	uint64_t loop_ns;
+	size_t bytes;
+	size_t items;
+	double ns_per_op[_SCU_BENCH_BATCHES];
+} _scu_bench = {.iterations = 1};
+
+static uint64_t
+_scu_get_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t
+_scu_bench_start(void)
+{
+	_scu_bench.loop_used = true;
+	_scu_bench.start_ns = _scu_get_monotonic_ns();
+	return _scu_bench.iterations;
+}
+
+void
+_scu_bench_stop(void)
+{
+	_scu_bench.loop_ns = _scu_get_monotonic_ns() - _scu_bench.start_ns;
+}
 
-static void
-_scu_flush_json(void)
+void
+_scu_bench_set_bytes(size_t bytes)
 {
-	write(_scu_cmd_fd, "\n", 1);
+	_scu_bench.bytes = bytes;
 }
 
-static void
-_scu_output_module_list(const char *modulename)
+void
+_scu_bench_set_items(size_t items)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "module_list");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "name");
-	json_string(_scu_cmd_fd, modulename);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	_scu_bench.items = items;
 }
 
-static void
-_scu_output_test_list(int line, const char *name, const char *description, const char *tags[])
-{
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "testcase_list");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "line");
-	json_integer(_scu_cmd_fd, line);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "name");
-	json_string(_scu_cmd_fd, name);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "description");
-	json_string(_scu_cmd_fd, description);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "tags");
-	json_array_start(_scu_cmd_fd);
-	if (*tags) {
-		json_string(_scu_cmd_fd, tags[0]);
-		for (size_t i = 1; tags[i] && i < _SCU_MAX_TAGS; i++) {
-			json_separator(_scu_cmd_fd);
-			json_string(_scu_cmd_fd, tags[i]);
-		}
-	}
-	json_array_end(_scu_cmd_fd);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+/* Runs the benchmark once, returning the time of its loop (or of all of it, without a loop) */
+static uint64_t
+_scu_bench_batch(_scu_testcase *test, size_t iterations)
+{
+	_scu_bench.iterations = iterations;
+	_scu_bench.loop_used = false;
+	uint64_t start_ns = _scu_get_monotonic_ns();
+	test->func();
+	uint64_t end_ns = _scu_get_monotonic_ns();
+	return _scu_bench.loop_used ? _scu_bench.loop_ns : end_ns - start_ns;
 }
 
-static void
-_scu_output_setup_start(const char *filename)
+/* Square root by Newton's method, to not require test modules to link with libm */
+static double
+_scu_sqrt(double x)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "setup_start");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "output");
-	json_string(_scu_cmd_fd, filename);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	if (x <= 0)
+		return 0;
+	double root = x > 1 ? x : 1, previous;
+	do {
+		previous = root;
+		root = (root + x / root) / 2;
+	} while (root < previous);
+	return previous;
 }
-static void
-_scu_output_setup_end(void)
+
+static int
+_scu_double_comparator(const void *a, const void *b)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "setup_end");
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
 }
 
 static void
-_scu_output_teardown_start(const char *filename)
+_scu_run_bench(_scu_testcase *test, _scu_bench_result *result)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "teardown_start");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "output");
-	json_string(_scu_cmd_fd, filename);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	memset(result, 0, sizeof(*result));
+	_scu_bench.bytes = 0;
+	_scu_bench.items = 0;
+
+	/* Calibrate the number of iterations to make a batch take about _SCU_BENCH_BATCH_NS */
+	size_t iterations = 1;
+	uint64_t ns = _scu_bench_batch(test, iterations);
+	while (_scu_test_passed() && _scu_bench.loop_used && ns < _SCU_BENCH_BATCH_NS && iterations < _SCU_BENCH_MAX_ITERATIONS) {
+		double factor = ns ? _SCU_BENCH_BATCH_NS / ns : 100;
+		if (factor > 100)
+			factor = 100;
+		else if (factor < 2)
+			factor = 2;
+		iterations *= factor;
+		ns = _scu_bench_batch(test, iterations);
+	}
+	if (!_scu_bench.loop_used)
+		iterations = 1;
+
+	for (size_t i = 0; i < _SCU_BENCH_WARMUP_BATCHES && _scu_test_passed(); i++)
+		_scu_bench_batch(test, iterations);
+
+	size_t batches = 0;
+	while (batches < _SCU_BENCH_BATCHES && _scu_test_passed()) {
+		ns = _scu_bench_batch(test, iterations);
+		_scu_bench.ns_per_op[batches++] = (double)ns / iterations;
+		result->total_ns += ns;
+	}
+	_scu_bench.iterations = 1;
+	if (!batches)
+		return;
+
+	double *samples = _scu_bench.ns_per_op;
+	double sum = 0, squares = 0;
+	for (size_t i = 0; i < batches; i++)
+		sum += samples[i];
+	double mean = sum / batches;
+	for (size_t i = 0; i < batches; i++)
+		squares += (samples[i] - mean) * (samples[i] - mean);
+	qsort(samples, batches, sizeof(samples[0]), _scu_double_comparator);
+
+	result->iterations = iterations;
+	result->batches = batches;
+	result->mean_ns = mean;
+	result->median_ns = batches % 2 ? samples[batches / 2] : (samples[batches / 2 - 1] + samples[batches / 2]) / 2;
+	result->stddev_ns = batches > 1 ? _scu_sqrt(squares / (batches - 1)) : 0;
+	result->p99_ns = samples[(batches * 99 + 99) / 100 - 1];
+	result->min_ns = samples[0];
+	result->bytes = _scu_bench.bytes;
+	result->items = _scu_bench.items;
 }
-static void
-_scu_output_teardown_end(void)
+
+/* Stress tests */
+
+#define _SCU_MAX_STRESS_THREADS 256
+
+/* Holds the threads until all of them have been created */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool released;
+} _scu_stress_barrier = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false};
+
+typedef struct {
+	_scu_testcase *test;
+	size_t index;
+	size_t ops;
+	uint64_t ns;
+} _scu_stress_worker;
+
+static void *
+_scu_stress_thread(void *arg)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "teardown_end");
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	_scu_stress_worker *worker = arg;
+	jmp_buf jmpbuf;
+
+	_scu_thread.id = worker->index + 1;
+	_scu_register_thread();
+	_scu_fatal_assert_jmpbuf = &jmpbuf;
+	_scu_thread.fatal_assert_allowed = true;
+
+	pthread_mutex_lock(&_scu_stress_barrier.mutex);
+	while (!_scu_stress_barrier.released)
+		pthread_cond_wait(&_scu_stress_barrier.cond, &_scu_stress_barrier.mutex);
+	pthread_mutex_unlock(&_scu_stress_barrier.mutex);
+
+	/* Left at the failing iteration by a fatal assertion */
+	volatile size_t i = 0;
+	uint64_t start_ns = _scu_get_monotonic_ns();
+	if (!setjmp(jmpbuf)) {
+		for (; i < worker->test->stress_iterations; i++)
+			worker->test->stress_func(worker->index, i);
+	}
+	worker->ns = _scu_get_monotonic_ns() - start_ns;
+	worker->ops = i;
+
+	_scu_thread.fatal_assert_allowed = false;
+	_scu_fatal_assert_jmpbuf = NULL;
+	return NULL;
 }
 
 static void
-_scu_output_test_start(int idx, const char *name, const char *filename)
+_scu_run_stress(_scu_testcase *test, _scu_stress_result *result)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "testcase_start");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "index");
-	json_integer(_scu_cmd_fd, idx);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "name");
-	json_string(_scu_cmd_fd, name);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "output");
-	json_string(_scu_cmd_fd, filename);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	size_t num_threads = test->stress_threads;
+	if (!num_threads || num_threads > _SCU_MAX_STRESS_THREADS) {
+		_scu_add_failure(__FILE__, __LINE__, "Stress test threads must be 1 to %d, not %zu",
+		                 _SCU_MAX_STRESS_THREADS, num_threads);
+		return;
+	}
+
+	_scu_stress_worker *workers = calloc(num_threads, sizeof(*workers));
+	pthread_t *threads = calloc(num_threads, sizeof(*threads));
+
+	_scu_stress_barrier.released = false;
+	size_t started = 0;
+	for (; started < num_threads; started++) {
+		workers[started] = (_scu_stress_worker){test, started, 0, 0};
+		int err = pthread_create(&threads[started], NULL, _scu_stress_thread, &workers[started]);
+		if (err) {
+			_scu_add_failure(__FILE__, __LINE__, "Failed to start stress test thread %zu: %s", started + 1,
+			                 strerror(err));
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&_scu_stress_barrier.mutex);
+	_scu_stress_barrier.released = true;
+	pthread_cond_broadcast(&_scu_stress_barrier.cond);
+	pthread_mutex_unlock(&_scu_stress_barrier.mutex);
+	uint64_t start_ns = _scu_get_monotonic_ns();
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	uint64_t total_ns = _scu_get_monotonic_ns() - start_ns;
+	free(threads);
+
+	/* Of the last run, when repeated */
+	free(result->ops);
+	free(result->ns);
+	result->threads = started;
+	result->iterations = test->stress_iterations;
+	result->total_ns = total_ns;
+	result->ops = malloc(sizeof(size_t) * (started ? started : 1));
+	result->ns = malloc(sizeof(uint64_t) * (started ? started : 1));
+	for (size_t i = 0; i < started; i++) {
+		result->ops[i] = workers[i].ops;
+		result->ns[i] = workers[i].ns;
+	}
+	free(workers);
 }
 
+/* Performance counters */
+
+static bool _scu_perf_enabled;
+static pid_t _scu_perf_pid;
+static int _scu_perf_fds[_SCU_PERF_COUNTERS];
+
+/*
+ * The counters follow the thread running the tests and the threads it
+ * creates. Counters which can not be opened, such as hardware counters in
+ * many containers and virtual machines, are left out of the results.
+ */
 static void
-_scu_output_test_failure(_scu_failure *failure)
+_scu_perf_open(void)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "file");
-	json_string(_scu_cmd_fd, failure->file);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "line");
-	json_integer(_scu_cmd_fd, failure->line);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "message");
-	json_string(_scu_cmd_fd, failure->msg);
-	json_object_end(_scu_cmd_fd);
+	/* A forked child has to count for itself */
+	pid_t pid = getpid();
+	if (_scu_perf_pid == pid)
+		return;
+	for (size_t i = 0; i < _SCU_PERF_COUNTERS; i++) {
+		if (_scu_perf_pid && _scu_perf_fds[i] >= 0)
+			close(_scu_perf_fds[i]);
+		struct perf_event_attr attr = {0};
+		attr.size = sizeof(attr);
+		attr.type = _scu_perf_counters[i].type;
+		attr.config = _scu_perf_counters[i].config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		/* Software events such as context switches occur in the kernel, count them there if allowed */
+		attr.exclude_kernel = attr.type != PERF_TYPE_SOFTWARE;
+		_scu_perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (_scu_perf_fds[i] < 0 && !attr.exclude_kernel) {
+			attr.exclude_kernel = 1;
+			_scu_perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		}
+	}
+	_scu_perf_pid = pid;
 }
 
+/* Counting continues from the previous stop unless reset, to count over the runs of a repeated test */
 static void
-_scu_output_test_failures(size_t num, _scu_failure *failures)
+_scu_perf_start(bool reset)
 {
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "failures");
-	json_array_start(_scu_cmd_fd);
-	if (num > 0) {
-		_scu_output_test_failure(&failures[0]);
-		for (size_t i = 1; i < num; i++) {
-			json_separator(_scu_cmd_fd);
-			_scu_output_test_failure(&failures[i]);
+	for (size_t i = 0; i < _SCU_PERF_COUNTERS; i++) {
+		if (_scu_perf_fds[i] >= 0) {
+			if (reset)
+				ioctl(_scu_perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(_scu_perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
 		}
 	}
-	json_array_end(_scu_cmd_fd);
 }
 
 static void
-_scu_output_test_end(int idx, bool success, size_t asserts,
-                     double mono_time, double cpu_time,
-                     size_t num_failures, _scu_failure *failures,
-                     size_t valgrind_errors)
-{
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "testcase_end");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "index");
-	json_integer(_scu_cmd_fd, idx);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "success");
-	json_boolean(_scu_cmd_fd, success);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "asserts");
-	json_integer(_scu_cmd_fd, asserts);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "duration");
-	json_real(_scu_cmd_fd, mono_time);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "cpu_time");
-	json_real(_scu_cmd_fd, cpu_time);
-	_scu_output_test_failures(num_failures, failures);
-	if (valgrind_errors) {
-		json_separator(_scu_cmd_fd);
-		json_object_key(_scu_cmd_fd, "valgrind_errors");
-		json_integer(_scu_cmd_fd, valgrind_errors);
+_scu_perf_stop(_scu_perf_values *perf)
+{
+	for (size_t i = 0; i < _SCU_PERF_COUNTERS; i++) {
+		if (_scu_perf_fds[i] >= 0)
+			ioctl(_scu_perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	for (size_t i = 0; i < _SCU_PERF_COUNTERS; i++) {
+		uint64_t data[3];
+		perf->available[i] = _scu_perf_fds[i] >= 0 && read(_scu_perf_fds[i], data, sizeof(data)) == sizeof(data);
+		if (!perf->available[i])
+			continue;
+		/* Scale up counts of counters which were multiplexed with others */
+		perf->values[i] = data[0];
+		if (data[2] && data[2] < data[1])
+			perf->values[i] = (double)data[0] * data[1] / data[2];
 	}
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
 }
 
-static void
-_scu_output_test_error(const char *file, int line, const char *msg)
+/* Test case timeouts */
+
+/*
+ * A test case which runs for longer than its timeout is stopped by a
+ * watchdog. The watchdog writes a stack snapshot of every thread to
+ * the output of the test case, reports the timeout and exits the module, as
+ * the test case can not be safely abandoned. The timeout is set per test
+ * case with a "timeout=SECONDS" tag, or for all test cases with --timeout.
+ */
+
+#define _SCU_TIMEOUT_TAG "timeout="
+#define _SCU_TIMEOUT_EXIT_STATUS 124
+#define _SCU_SNAPSHOT_FRAMES 64
+#define _SCU_SNAPSHOT_WAIT_MS 200
+
+static double _scu_default_timeout;
+static volatile sig_atomic_t _scu_snapshot_done;
+static const char *volatile _scu_snapshot_title;
+
+/*
+ * The watchdog is a thread of its own, which waits for the deadline of the
+ * running test case. Reporting from a thread rather than a signal handler
+ * keeps the report away from whatever the test case was doing, and only the
+ * stack snapshots are taken in signal handlers, each by the thread itself.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pid_t pid;
+	bool armed;
+	struct timespec deadline;
+	double timeout;
+	pid_t test_tid;
+} _scu_watchdog;
+
+/* The watchdog reports with a buffer of its own, as the test case may be using _scu_cmd */
+static json_buffer _scu_watchdog_cmd;
+
+static double
+_scu_test_timeout(_scu_testcase *test)
 {
-	json_object_start(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "event");
-	json_string(_scu_cmd_fd, "testcase_error");
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "message");
-	json_string(_scu_cmd_fd, msg);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "file");
-	json_string(_scu_cmd_fd, file);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "line");
-	json_integer(_scu_cmd_fd, line);
-	json_separator(_scu_cmd_fd);
-	json_object_key(_scu_cmd_fd, "crash");
-	json_true(_scu_cmd_fd);
-	json_object_end(_scu_cmd_fd);
-	_scu_flush_json();
+	for (size_t i = 0; i < test->num_tags; i++) {
+		if (strncmp(test->tags[i], _SCU_TIMEOUT_TAG, strlen(_SCU_TIMEOUT_TAG)) == 0)
+			return strtod(test->tags[i] + strlen(_SCU_TIMEOUT_TAG), NULL);
+	}
+	return _scu_default_timeout;
 }
 
 static void
-_scu_redirect_output(char *filename, size_t len)
+_scu_write_string(int fd, const char *str)
 {
-	strncpy(filename, SCU_OUTPUT_FILENAME_TEMPLATE, len);
-	int out = mkstemp(filename);
-	assert(out >= 0);
-	dup2(out, STDOUT_FILENO);
-	dup2(out, STDERR_FILENO);
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
+	size_t len = strlen(str);
+	while (len > 0) {
+		ssize_t res = write(fd, str, len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		str += res;
+		len -= res;
+	}
 }
 
-/* Module actions */
-
+/* Writes the stack of the calling thread using only async-signal-safe calls, once backtrace() is loaded */
 static void
-list_tests(void)
+_scu_write_backtrace(const char *title, pid_t tid)
 {
-	_scu_cmd_fd = STDOUT_FILENO;
+	char number[16];
+	size_t pos = sizeof(number);
+	number[--pos] = 0;
+	do {
+		number[--pos] = '0' + tid % 10;
+		tid /= 10;
+	} while (tid > 0 && pos > 0);
+	_scu_write_string(STDOUT_FILENO, "\n");
+	_scu_write_string(STDOUT_FILENO, title);
+	_scu_write_string(STDOUT_FILENO, " ");
+	_scu_write_string(STDOUT_FILENO, number + pos);
+	_scu_write_string(STDOUT_FILENO, ":\n");
+	void *frames[_SCU_SNAPSHOT_FRAMES];
+	int num_frames = backtrace(frames, _SCU_SNAPSHOT_FRAMES);
+	backtrace_symbols_fd(frames, num_frames, STDOUT_FILENO);
+}
 
-	_scu_output_module_list(_scu_module_name);
+static void
+_scu_snapshot_handler(int sig)
+{
+	(void)sig;
+	int saved_errno = errno;
+	_scu_write_backtrace(_scu_snapshot_title, _scu_get_current_thread_id());
+	_scu_snapshot_done = 1;
+	errno = saved_errno;
+}
 
-	for (size_t i = 0; i < _scu_module_num_tests; i++) {
-		_scu_testcase *test = _scu_module_tests[i];
-		_scu_output_test_list(test->line, test->name, test->desc, test->tags);
+/* Has a thread write its stack, waiting a while for it to do so */
+static void
+_scu_snapshot_thread(pid_t tid, const char *title)
+{
+	_scu_snapshot_title = title;
+	_scu_snapshot_done = 0;
+	if (syscall(SYS_tgkill, getpid(), tid, SIGRTMIN) != 0)
+		return;
+	for (int i = 0; i < _SCU_SNAPSHOT_WAIT_MS && !_scu_snapshot_done; i++) {
+		struct timespec delay = {0, 1000000};
+		nanosleep(&delay, NULL);
 	}
 }
 
-static double
-_scu_get_time_diff(struct timespec startt, struct timespec endt)
+/* Has the thread running the test case and then every other thread write its stack, one at a time */
+static void
+_scu_snapshot_threads(pid_t test_tid)
 {
-	time_t dsec = endt.tv_sec - startt.tv_sec;
-	long dnsec = endt.tv_nsec - startt.tv_nsec;
-
-	if (dnsec < 0) {
-		dnsec += 1000000000;
-		dsec--;
+	_scu_snapshot_thread(test_tid, "Test case timed out, stack of thread");
+
+	pid_t self = _scu_get_current_thread_id();
+	DIR *dir = opendir("/proc/self/task");
+	if (!dir)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		pid_t tid = atoi(entry->d_name);
+		if (tid > 0 && tid != self && tid != test_tid)
+			_scu_snapshot_thread(tid, "Thread");
 	}
-
-	return dsec + dnsec / 1e9;
+	closedir(dir);
 }
 
-static bool _scu_fatal_assert_jmpbuf_valid;
-static pid_t _scu_fatal_assert_allowed_thread_id;
-static jmp_buf _scu_fatal_assert_jmpbuf;
-
-static pid_t
-_scu_get_current_thread_id(void)
+static void
+_scu_report_timeout(double timeout, pid_t test_tid)
 {
-	return syscall(SYS_gettid);
+	_scu_snapshot_threads(test_tid);
+
+	_scu_watchdog_cmd.fd = _scu_cmd.fd;
+	json_set_framed(&_scu_watchdog_cmd, _scu_cmd.framed);
+	if (_scu_compact) {
+		_scu_flush_passes(&_scu_watchdog_cmd);
+		_scu_flush_deferred_json(&_scu_watchdog_cmd);
+	}
+	char msg[128];
+	snprintf(msg, sizeof(msg), "Test case timed out after %g s (stack snapshot in output)", timeout);
+	_scu_output_test_error_event(&_scu_watchdog_cmd, NULL, 0, msg, true);
+	_exit(_SCU_TIMEOUT_EXIT_STATUS);
 }
 
-void
-_scu_fatal_assert_allowed(const char *file, int line)
+static void *
+_scu_watchdog_thread(void *arg)
 {
-	assert(_scu_fatal_assert_jmpbuf_valid);
-	if (_scu_get_current_thread_id() != _scu_fatal_assert_allowed_thread_id) {
-		_scu_output_test_error(file, line, "Attempt to use fatal assert outside main thread");
-		abort();
+	(void)arg;
+	pthread_mutex_lock(&_scu_watchdog.mutex);
+	for (;;) {
+		if (!_scu_watchdog.armed) {
+			pthread_cond_wait(&_scu_watchdog.cond, &_scu_watchdog.mutex);
+			continue;
+		}
+		pthread_cond_timedwait(&_scu_watchdog.cond, &_scu_watchdog.mutex, &_scu_watchdog.deadline);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (_scu_watchdog.armed && _scu_get_time_diff(_scu_watchdog.deadline, now) >= 0)
+			break;
 	}
+	/* The mutex is kept, so that the test case can not finish while the timeout is reported */
+	_scu_report_timeout(_scu_watchdog.timeout, _scu_watchdog.test_tid);
+	return NULL;
 }
 
-void
-_scu_handle_fatal_assert(void)
+/* Starts the watchdog of this process, which after a fork() is not the one of the parent */
+static void
+_scu_start_watchdog(void)
 {
-	longjmp(_scu_fatal_assert_jmpbuf, 1);
+	/* Load what backtrace() needs now, rather than in a signal handler */
+	void *frame;
+	backtrace(&frame, 1);
+	struct sigaction action = {.sa_handler = _scu_snapshot_handler, .sa_flags = SA_RESTART};
+	sigaction(SIGRTMIN, &action, NULL);
+
+	pthread_mutex_init(&_scu_watchdog.mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&_scu_watchdog.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	_scu_watchdog.armed = false;
+
+	/* Signals are for the threads of the test case, not for the watchdog */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	int res = pthread_create(&thread, NULL, _scu_watchdog_thread, NULL);
+	assert(res == 0);
+	pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	_scu_watchdog.pid = getpid();
 }
 
-static _scu_failure _failures[_SCU_MAX_FAILURES];
-
 static void
-_scu_run_test(int idx)
+_scu_set_watchdog(double timeout)
 {
-	_scu_testcase *test = _scu_module_tests[idx];
+	if (_scu_watchdog.pid != getpid()) {
+		if (timeout <= 0)
+			return;
+		_scu_start_watchdog();
+	}
 
-	char filename[SCU_OUTPUT_FILENAME_TEMPLATE_SIZE];
-	_scu_redirect_output(filename, sizeof(filename));
+	pthread_mutex_lock(&_scu_watchdog.mutex);
+	_scu_watchdog.armed = timeout > 0;
+	if (_scu_watchdog.armed) {
+		clock_gettime(CLOCK_MONOTONIC, &_scu_watchdog.deadline);
+		_scu_watchdog.deadline.tv_sec += (time_t)timeout;
+		_scu_watchdog.deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+		if (_scu_watchdog.deadline.tv_nsec >= 1000000000) {
+			_scu_watchdog.deadline.tv_sec++;
+			_scu_watchdog.deadline.tv_nsec -= 1000000000;
+		}
+		_scu_watchdog.timeout = timeout;
+		_scu_watchdog.test_tid = _scu_get_current_thread_id();
+		pthread_cond_signal(&_scu_watchdog.cond);
+	}
+	pthread_mutex_unlock(&_scu_watchdog.mutex);
+}
 
-	VALGRIND_PRINTF("\n** SCU: Starting test \"%s\" **\n\n", test->name);
+/* Runs of each test case, none for repeating until a run fails without a limit */
+static size_t _scu_repeat = 1;
+static bool _scu_repeat_until_fail;
 
-	_scu_output_test_start(idx, test->name, filename);
+/* Accumulated results of the runs of a test case */
+typedef struct {
+	size_t runs;
+	size_t failed;
+	size_t first_failure;
+	size_t asserts;
+	double mono_time;
+	double cpu_time;
+	_scu_rusage usage;
+	_scu_perf_values perf;
+	_scu_bench_result bench;
+	_scu_stress_result stress;
+	/* Times of the individual runs, kept for repeated test cases */
+	size_t capacity;
+	double *mono_times;
+	double *cpu_times;
+} _scu_test_runs;
 
+static void
+_scu_run_once(_scu_case *tc, double timeout, _scu_test_runs *runs)
+{
+	_scu_testcase *test = tc->test;
 	struct timespec start_mono_time, end_mono_time, start_cpu_time, end_cpu_time;
 
-	unsigned valgrind_errors_before = VALGRIND_COUNT_ERRORS;
+	_scu_set_watchdog(timeout);
 
 	_scu_before_each();
 
 	clock_gettime(CLOCK_MONOTONIC, &start_mono_time);
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu_time);
 
-	bool success = true;
-	size_t asserts = 0, num_failures = 0;
+	/* Only the failures of the first failing run are reported */
+	if (!runs->failed)
+		_scu_reset_failures();
+	_scu_failures_mark mark = _scu_mark_failures();
+	_scu_reset_asserts();
 
+	_scu_fatal_assert_jmpbuf = &_scu_main_jmpbuf;
 	_scu_fatal_assert_jmpbuf_valid = true;
-	_scu_fatal_assert_allowed_thread_id = _scu_get_current_thread_id();
-	if (!setjmp(_scu_fatal_assert_jmpbuf)) {
-		test->func(&success, &asserts, &num_failures, _failures);
+	_scu_thread.fatal_assert_allowed = true;
+	_scu_rusage usage;
+	_scu_get_rusage(&usage);
+	if (_scu_perf_enabled)
+		_scu_perf_start(runs->runs == 0);
+	if (!setjmp(_scu_main_jmpbuf)) {
+		if (test->bench)
+			_scu_run_bench(test, &runs->bench);
+		else if (test->stress_func)
+			_scu_run_stress(test, &runs->stress);
+		else if (test->param_func)
+			test->param_func(_scu_case_param(tc));
+		else
+			test->func();
 	}
-	_scu_fatal_assert_allowed_thread_id = 0;
+	if (_scu_perf_enabled)
+		_scu_perf_stop(&runs->perf);
+	_scu_rusage_delta(&usage);
+	_scu_thread.fatal_assert_allowed = false;
 	_scu_fatal_assert_jmpbuf_valid = false;
 
 	clock_gettime(CLOCK_MONOTONIC, &end_mono_time);
@@ -360,22 +1975,330 @@ _scu_run_test(int idx)
 
 	_scu_after_each();
 
+	_scu_set_watchdog(0);
+
+	double mono_time = _scu_get_time_diff(start_mono_time, end_mono_time);
+	double cpu_time = _scu_get_time_diff(start_cpu_time, end_cpu_time);
+	runs->mono_time += mono_time;
+	runs->cpu_time += cpu_time;
+	runs->asserts += _scu_count_asserts();
+	for (size_t i = 0; i < _SCU_RUSAGE_FIELDS; i++)
+		runs->usage.values[i] += usage.values[i];
+
+	_scu_check_protocol_guard();
+
+	if (_scu_failures_added(&mark)) {
+		if (runs->failed)
+			_scu_restore_failures(&mark);
+		else
+			runs->first_failure = runs->runs;
+		runs->failed++;
+	}
+
+	if (runs->mono_times) {
+		if (runs->runs == runs->capacity) {
+			runs->capacity *= 2;
+			runs->mono_times = realloc(runs->mono_times, sizeof(double) * runs->capacity);
+			runs->cpu_times = realloc(runs->cpu_times, sizeof(double) * runs->capacity);
+		}
+		runs->mono_times[runs->runs] = mono_time;
+		runs->cpu_times[runs->runs] = cpu_time;
+	}
+	runs->runs++;
+}
+
+/* Sorts the times, leaving the minimum, median and maximum in stats */
+static void
+_scu_time_stats(double *times, size_t count, double *stats)
+{
+	qsort(times, count, sizeof(double), _scu_double_comparator);
+	stats[0] = times[0];
+	stats[1] = count % 2 ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2;
+	stats[2] = times[count - 1];
+}
+
+static void
+_scu_run_test(int idx)
+{
+	_scu_case *tc = &_scu_module_cases[idx];
+	_scu_testcase *test = tc->test;
+	char name_buf[_SCU_JSON_STRING_LENGTH];
+	const char *name = _scu_case_name(tc, name_buf, sizeof(name_buf));
+
+	char filename[SCU_OUTPUT_FILENAME_LENGTH];
+	_scu_redirect_output(filename, sizeof(filename));
+
+	VALGRIND_PRINTF("\n** SCU: Starting test \"%s\" **\n\n", name);
+
+	if (_scu_perf_enabled)
+		_scu_perf_open();
+
+	_scu_output_test_start(idx, name, filename);
+
+	/* The runner takes the first test not reported as the one running */
+	double timeout = _scu_test_timeout(test);
+	if (_scu_compact && timeout > 0)
+		_scu_flush_passes(&_scu_cmd);
+
+	/* Benchmarks repeat their loop by themselves */
+	bool repeated = !test->bench && (_scu_repeat != 1 || _scu_repeat_until_fail);
+	size_t max_runs = test->bench ? 1 : _scu_repeat;
+	_scu_test_runs runs = {0};
+	if (repeated) {
+		runs.capacity = max_runs ? max_runs : 64;
+		runs.mono_times = malloc(sizeof(double) * runs.capacity);
+		runs.cpu_times = malloc(sizeof(double) * runs.capacity);
+	}
+
+	unsigned valgrind_errors_before = VALGRIND_COUNT_ERRORS;
+
+	do {
+		_scu_run_once(tc, timeout, &runs);
+	} while ((!max_runs || runs.runs < max_runs) && !(_scu_repeat_until_fail && runs.failed));
+
 	unsigned valgrind_errors_after = VALGRIND_COUNT_ERRORS;
 
 	unsigned valgrind_error_count = valgrind_errors_after - valgrind_errors_before;
 
-	_scu_output_test_end(idx, success && !valgrind_error_count, asserts,
-	                     _scu_get_time_diff(start_mono_time, end_mono_time),
-	                     _scu_get_time_diff(start_cpu_time, end_cpu_time),
-	                     num_failures, _failures, valgrind_error_count);
+	bool success = !runs.failed && !valgrind_error_count;
+
+	_scu_repeat_stats repeat = {runs.runs, runs.failed, runs.first_failure, {0}, {0}};
+	if (repeated) {
+		_scu_time_stats(runs.mono_times, runs.runs, repeat.mono_time);
+		_scu_time_stats(runs.cpu_times, runs.runs, repeat.cpu_time);
+		free(runs.mono_times);
+		free(runs.cpu_times);
+	}
+
+	if (_scu_compact) {
+		if (success && !test->bench && !test->stress_func && !repeated && !_scu_perf_enabled &&
+		    _scu_is_quiet_pass(runs.mono_time, &runs.usage)) {
+			if (!_scu_output_memfd)
+				unlink(filename);
+			_scu_deferred_event_len = 0;
+			_scu_add_pass(idx, runs.asserts, runs.mono_time, runs.cpu_time, &runs.usage);
+			return;
+		}
+		_scu_flush_passes(&_scu_cmd);
+		_scu_flush_deferred_json(&_scu_cmd);
+	}
+
+	if (runs.bench.batches)
+		_scu_output_bench_result(idx, &runs.bench);
+	if (runs.stress.ops) {
+		_scu_output_stress_result(idx, &runs.stress);
+		free(runs.stress.ops);
+		free(runs.stress.ns);
+	}
+
+	_scu_output_test_end(idx, success, runs.asserts, runs.mono_time, runs.cpu_time,
+	                     valgrind_error_count, &runs.usage,
+	                     _scu_perf_enabled ? &runs.perf : NULL,
+	                     repeated ? &repeat : NULL);
+}
+
+/* Forked test execution */
+
+#define _SCU_MAX_FORK_SLOTS 256
+
+typedef struct {
+	pid_t pid;
+	int fd;
+	bool exited;
+	int status;
+	bool partial_line;
+} _scu_fork_slot;
+
+static _scu_fork_slot _scu_fork_slots[_SCU_MAX_FORK_SLOTS];
+static int _scu_sigchld_pipe[2];
+
+static void
+_scu_sigchld_handler(int sig)
+{
+	(void)sig;
+	int saved_errno = errno;
+	write(_scu_sigchld_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+static void
+_scu_fork_test(_scu_fork_slot *slot, int idx)
+{
+	/* A socket rather than a pipe, so that the child can pass its output memfds */
+	int fds[2];
+	int res = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(res == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		/* Keep the protocol fd number, so the child behaves as in a non-forked run */
+		signal(SIGCHLD, SIG_DFL);
+		close(fds[0]);
+		dup2(fds[1], _scu_cmd.fd);
+		close(fds[1]);
+		/* A guard of its own, not shared with the other children */
+		if (_scu_protocol_guard_fd >= 0)
+			_scu_open_protocol_guard();
+		_scu_run_test(idx);
+		_scu_flush_passes(&_scu_cmd);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	slot->pid = pid;
+	slot->fd = fds[0];
+	slot->exited = false;
+	slot->partial_line = false;
+}
+
+static size_t
+_scu_reap_fork_slots(size_t head, size_t used)
+{
+	size_t reaped = 0;
+	for (size_t i = 0; i < used; i++) {
+		_scu_fork_slot *slot = &_scu_fork_slots[(head + i) % _SCU_MAX_FORK_SLOTS];
+		if (!slot->exited && waitpid(slot->pid, &slot->status, WNOHANG) == slot->pid) {
+			slot->exited = true;
+			reaped++;
+		}
+	}
+	return reaped;
+}
+
+static bool
+_scu_relay_fork_slot(_scu_fork_slot *slot)
+{
+	char buf[4096];
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(int) * _SCU_JSON_MAX_FDS)];
+	} control;
+	struct iovec iov = {buf, sizeof(buf)};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len = recvmsg(slot->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		return errno == EINTR;
+	if (len == 0)
+		return false;
+
+	/*
+	 * Pass the output memfds of the child on with its events. Fds which do
+	 * not fit (MSG_CTRUNC) are closed by the kernel, and fds which can not be
+	 * attached are closed here. The runner matches fds with events by inode,
+	 * so only the output of the events referring to them is lost.
+	 */
+	int fds[_SCU_JSON_MAX_FDS];
+	size_t num_fds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < n; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (num_fds < _SCU_JSON_MAX_FDS && json_attach_fd(&_scu_cmd, fd))
+				fds[num_fds++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	if (!_scu_compact) {
+		for (ssize_t i = 0; i < len; i++) {
+			if (buf[i] == '\n')
+				_scu_cmd_events++;
+		}
+		slot->partial_line = buf[len - 1] != '\n';
+	}
+	json_write(&_scu_cmd, buf, len);
+	for (size_t i = 0; i < num_fds; i++)
+		close(fds[i]);
+	return true;
+}
+
+static void
+_scu_report_fork_status(_scu_fork_slot *slot)
+{
+	/* A child which timed out has reported it */
+	if (WIFEXITED(slot->status) && (WEXITSTATUS(slot->status) == 0 || WEXITSTATUS(slot->status) == _SCU_TIMEOUT_EXIT_STATUS))
+		return;
+
+	char msg[128];
+	if (WIFSIGNALED(slot->status))
+		snprintf(msg, sizeof(msg), "Test case crashed (%s)", strsignal(WTERMSIG(slot->status)));
+	else
+		snprintf(msg, sizeof(msg), "Test case exited with status %d", WEXITSTATUS(slot->status));
+
+	/* Terminate an event the child did not get to finish */
+	if (slot->partial_line)
+		_scu_flush_json();
+	_scu_output_test_error(NULL, 0, msg);
 }
 
 static void
-run_tests(size_t num_tests, long int test_indices[])
+_scu_run_tests_forked(size_t num_tests, long int test_indices[], size_t jobs)
 {
-	_scu_cmd_fd = dup(STDOUT_FILENO);
+	size_t next = 0, head = 0, used = 0, running = 0;
+
+	int res = pipe(_scu_sigchld_pipe);
+	assert(res == 0);
+	fcntl(_scu_sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+	struct sigaction action = {.sa_handler = _scu_sigchld_handler, .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+	struct sigaction old_action;
+	sigaction(SIGCHLD, &action, &old_action);
+
+	/*
+	 * Up to `jobs` children run simultaneously, but their events are relayed
+	 * one child at a time, in the order the tests were requested. Children
+	 * that are not being relayed yet leave their events in their pipe.
+	 */
+	while (next < num_tests || used > 0) {
+		while (next < num_tests && running < jobs && used < _SCU_MAX_FORK_SLOTS) {
+			_scu_fork_test(&_scu_fork_slots[(head + used) % _SCU_MAX_FORK_SLOTS], test_indices[next++]);
+			used++;
+			running++;
+		}
 
-	char filename[SCU_OUTPUT_FILENAME_TEMPLATE_SIZE];
+		_scu_fork_slot *slot = &_scu_fork_slots[head];
+		struct pollfd fds[] = {{slot->fd, POLLIN, 0}, {_scu_sigchld_pipe[0], POLLIN, 0}};
+		if (poll(fds, 2, -1) < 0)
+			continue;
+
+		if (fds[1].revents) {
+			char buf[64];
+			read(_scu_sigchld_pipe[0], buf, sizeof(buf));
+			running -= _scu_reap_fork_slots(head, used);
+		}
+
+		if (fds[0].revents && !_scu_relay_fork_slot(slot)) {
+			if (!slot->exited) {
+				waitpid(slot->pid, &slot->status, 0);
+				slot->exited = true;
+				running--;
+			}
+			close(slot->fd);
+			_scu_report_fork_status(slot);
+			head = (head + 1) % _SCU_MAX_FORK_SLOTS;
+			used--;
+		}
+	}
+
+	sigaction(SIGCHLD, &old_action, NULL);
+	close(_scu_sigchld_pipe[0]);
+	close(_scu_sigchld_pipe[1]);
+}
+
+static void
+run_tests(size_t num_tests, long int test_indices[], size_t fork_jobs)
+{
+	char filename[SCU_OUTPUT_FILENAME_LENGTH];
 
 	_scu_redirect_output(filename, sizeof(filename));
 
@@ -385,10 +2308,16 @@ run_tests(size_t num_tests, long int test_indices[])
 
 	_scu_output_setup_end();
 
-	for (size_t i = 0; i < num_tests; i++) {
-		_scu_run_test(test_indices[i]);
+	if (fork_jobs) {
+		_scu_run_tests_forked(num_tests, test_indices, fork_jobs);
+	} else {
+		for (size_t i = 0; i < num_tests; i++) {
+			_scu_run_test(test_indices[i]);
+		}
 	}
 
+	_scu_flush_passes(&_scu_cmd);
+
 	_scu_redirect_output(filename, sizeof(filename));
 
 	_scu_output_teardown_start(filename);
@@ -398,18 +2327,127 @@ run_tests(size_t num_tests, long int test_indices[])
 	_scu_output_teardown_end();
 }
 
+static bool
+_scu_parse_index(const char *arg, long int *idx)
+{
+	errno = 0;
+	char *endptr = NULL;
+	*idx = strtol(arg, &endptr, 10);
+	return endptr != arg && errno == 0 && *idx >= 0 && (size_t)*idx < _scu_module_num_cases;
+}
+
+/* Command server */
+
+/* Sized for a command to run every test case of the module, once */
+static char *_scu_serve_buffer;
+static size_t _scu_serve_buffer_size;
+static size_t _scu_serve_buffer_len;
+static size_t _scu_serve_buffer_consumed;
+static long int *_scu_serve_indices;
+
+static char *
+_scu_read_command(int fd)
+{
+	/* Drop the previous command from the buffer */
+	_scu_serve_buffer_len -= _scu_serve_buffer_consumed;
+	memmove(_scu_serve_buffer, _scu_serve_buffer + _scu_serve_buffer_consumed, _scu_serve_buffer_len);
+	_scu_serve_buffer_consumed = 0;
+
+	for (;;) {
+		char *end = memchr(_scu_serve_buffer, '\n', _scu_serve_buffer_len);
+		if (end) {
+			*end = 0;
+			_scu_serve_buffer_consumed = end - _scu_serve_buffer + 1;
+			return _scu_serve_buffer;
+		}
+		if (_scu_serve_buffer_len == _scu_serve_buffer_size) {
+			_scu_output_command_error("command too long");
+			return NULL;
+		}
+		ssize_t len = read(fd, _scu_serve_buffer + _scu_serve_buffer_len, _scu_serve_buffer_size - _scu_serve_buffer_len);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return NULL;
+		_scu_serve_buffer_len += len;
+	}
+}
+
+static void
+serve(size_t fork_jobs)
+{
+	/* Commands are read from stdin, keep the test cases from consuming them */
+	int fd = dup(STDIN_FILENO);
+	int null = open("/dev/null", O_RDONLY);
+	dup2(null, STDIN_FILENO);
+	close(null);
+
+	_scu_serve_buffer_size = 64 + _scu_module_num_cases * 12;
+	_scu_serve_buffer = malloc(_scu_serve_buffer_size);
+	_scu_serve_indices = malloc(sizeof(long int) * (_scu_module_num_cases + 1));
+
+	char *command;
+	while ((command = _scu_read_command(fd))) {
+		char *saveptr = NULL;
+		char *word = strtok_r(command, " ", &saveptr);
+		if (!word)
+			continue;
+
+		if (strcmp(word, "quit") == 0) {
+			break;
+		} else if (strcmp(word, "list") == 0) {
+			list_tests();
+		} else if (strcmp(word, "run") == 0) {
+			size_t num_tests = 0;
+			while ((word = strtok_r(NULL, " ", &saveptr))) {
+				if (num_tests == _scu_module_num_cases || !_scu_parse_index(word, &_scu_serve_indices[num_tests]))
+					break;
+				num_tests++;
+			}
+			if (word)
+				_scu_output_command_error("invalid index");
+			else
+				run_tests(num_tests, _scu_serve_indices, fork_jobs);
+		} else {
+			_scu_output_command_error("unknown command");
+		}
+
+		_scu_output_command_end();
+	}
+
+	free(_scu_serve_indices);
+	free(_scu_serve_buffer);
+	close(fd);
+}
+
 /* Argument parsing */
 
 typedef struct {
 	bool list;
 	bool run;
+	bool serve;
+	bool compact;
+	bool perf;
+	double timeout;
+	size_t repeat;
+	bool repeat_until_fail;
+	size_t fork_jobs;
+	const char *output_dir;
 	size_t num_tests;
-	long int test_indices[_SCU_MAX_TESTS];
+	long int *test_indices;
 } _scu_arguments;
 
 static struct argp_option options[] = {
     {"list", 'l', 0, 0, "list available test cases", 0},
     {"run", 'r', 0, 0, "run the test cases identified by the supplied indices", 0},
+    {"serve", 's', 0, 0, "serve list, run and quit commands read from stdin", 0},
+    {"compact", 'c', 0, 0, "use the compact protocol, reporting quietly passing test cases in batches", 0},
+    {"fork", 'f', "JOBS", OPTION_ARG_OPTIONAL, "run each test case in a forked child process, up to JOBS at a time", 0},
+    {"timeout", 't', "SECONDS", 0, "stop test cases running longer than SECONDS, unless set with a timeout= tag", 0},
+    {"repeat", 'R', "N", 0, "run each test case N times, reporting statistics of the runs", 0},
+    {"repeat-until-fail", 'U', 0, 0, "repeat each test case until a run fails, at most N times if --repeat is given", 0},
+    {"perf", 'p', 0, 0, "measure performance counters of each test case, reporting them individually", 0},
+    {"output-dir", 'o', "DIR", 0, "directory for test output files, when output can not be passed as memfds (default " SCU_OUTPUT_DIR ")", 0},
     {0}};
 
 static error_t
@@ -424,20 +2462,61 @@ parse_opt(int key, char *arg, struct argp_state *state)
 		case 'r':
 			parsed_args->run = true;
 			break;
+		case 's':
+			parsed_args->serve = true;
+			break;
+		case 'c':
+			parsed_args->compact = true;
+			break;
+		case 'p':
+			parsed_args->perf = true;
+			break;
+		case 't': {
+			char *endptr = NULL;
+			parsed_args->timeout = strtod(arg, &endptr);
+			if (endptr == arg || *endptr != 0 || parsed_args->timeout < 0)
+				argp_error(state, "invalid timeout: %s", arg);
+			break;
+		}
+		case 'R': {
+			errno = 0;
+			char *endptr = NULL;
+			long int repeat = strtol(arg, &endptr, 10);
+			if (endptr == arg || *endptr != 0 || errno != 0 || repeat < 1)
+				argp_error(state, "invalid number of runs: %s", arg);
+			parsed_args->repeat = repeat;
+			break;
+		}
+		case 'U':
+			parsed_args->repeat_until_fail = true;
+			break;
+		case 'o':
+			parsed_args->output_dir = arg;
+			break;
+		case 'f': {
+			parsed_args->fork_jobs = 1;
+			if (arg) {
+				errno = 0;
+				char *endptr = NULL;
+				long int jobs = strtol(arg, &endptr, 10);
+				if (endptr == arg || *endptr != 0 || errno != 0 || jobs < 1 || jobs > _SCU_MAX_FORK_SLOTS)
+					argp_error(state, "invalid number of jobs: %s", arg);
+				parsed_args->fork_jobs = jobs;
+			}
+			break;
+		}
 		case ARGP_KEY_NO_ARGS:
-			if (!parsed_args->list && !parsed_args->run)
+			if (!parsed_args->list && !parsed_args->run && !parsed_args->serve)
 				argp_usage(state);
 			if (parsed_args->run)
 				argp_error(state, "not enough arguments");
 			break;
 		case ARGP_KEY_ARG: {
-			errno = 0;
-			char *endptr = NULL;
-			long int idx = strtol(arg, &endptr, 10);
-			if (endptr == arg || errno != 0 || idx < 0 ||
-			    (size_t)idx >= _scu_module_num_tests) {
+			long int idx;
+			if (!_scu_parse_index(arg, &idx))
 				argp_error(state, "invalid index: %s", arg);
-			}
+			if (parsed_args->num_tests == _scu_module_num_cases)
+				argp_error(state, "too many indices");
 			parsed_args->test_indices[parsed_args->num_tests++] = idx;
 			break;
 		}
@@ -475,21 +2554,71 @@ _scu_register_testcase(_scu_testcase *tc)
 	_scu_module_num_tests++;
 }
 
+static bool
+_scu_is_unix_socket(int fd)
+{
+	int domain;
+	socklen_t len = sizeof(domain);
+	return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
 int
 main(int argc, char *argv[])
 {
+	/* Test cases run in this thread, which is counted without a slot */
+	_scu_thread.registered = true;
+
+	qsort(_scu_module_tests, _scu_module_num_tests, sizeof(_scu_testcase *), _scu_line_comparator);
+	_scu_expand_cases();
+
 	_scu_arguments args = {0};
+	args.test_indices = malloc(sizeof(long int) * (_scu_module_num_cases + 1));
 
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
-	qsort(_scu_module_tests, _scu_module_num_tests, sizeof(_scu_testcase *), _scu_line_comparator);
+	/* Test output redirection takes over stderr, so keep a copy for the statistics */
+	int stats_fd = getenv("SCU_PROTOCOL_STATS") ? dup(STDERR_FILENO) : -1;
+
+	if (args.compact)
+		_scu_enable_compact_protocol();
+
+	if (args.output_dir)
+		_scu_output_dir = args.output_dir;
+
+	_scu_perf_enabled = args.perf;
+	_scu_default_timeout = args.timeout;
+	_scu_repeat_until_fail = args.repeat_until_fail;
+	if (args.repeat)
+		_scu_repeat = args.repeat;
+	else if (args.repeat_until_fail)
+		_scu_repeat = 0;
 
 	if (args.list) {
+		_scu_cmd.fd = STDOUT_FILENO;
 		list_tests();
 	} else if (args.run) {
-		run_tests(args.num_tests, args.test_indices);
+		_scu_cmd.fd = dup(STDOUT_FILENO);
+		_scu_output_pass_fds = _scu_is_unix_socket(_scu_cmd.fd);
+		if (args.compact)
+			_scu_guard_protocol_fd();
+		run_tests(args.num_tests, args.test_indices, args.fork_jobs);
+	} else if (args.serve) {
+		_scu_cmd.fd = dup(STDOUT_FILENO);
+		_scu_output_pass_fds = _scu_is_unix_socket(_scu_cmd.fd);
+		if (args.compact)
+			_scu_guard_protocol_fd();
+		serve(args.fork_jobs);
+	}
+
+	if (stats_fd >= 0) {
+		dprintf(stats_fd, "%s: %zu events, %zu write() calls (%.2f per event)\n",
+		        _scu_module_name, _scu_cmd_events, _scu_cmd.writes,
+		        _scu_cmd_events ? (double)_scu_cmd.writes / _scu_cmd_events : 0.0);
+		close(stats_fd);
 	}
 
+	free(args.test_indices);
+	free(_scu_module_cases);
 	free(_scu_module_tests);
 	return 0;
 }